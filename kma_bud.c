@@ -50,31 +50,51 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// buffer classes: 16 bytes doubling up to half a page, plus the rest of a page
+#define NUMCLASSES (PAGESHIFT - 3)
+
 typedef struct
 {
     int allocs;
-    int bufsizes[10];
-    void* lists[10];
+    int bufsizes[NUMCLASSES];
+    void* lists[NUMCLASSES];
     
 } free_list_t;
 
 typedef struct
 {
-    kma_page_t* page;
     void* next;
-    char bitmap[128];
+    char bitmap[PAGESIZE / 128]; // one bit per 16 bytes
 } page_t;
 
+// pages fetched with one get_pages_batch(); a growing pool asks for 1, 2,
+// 4, ... up to BUD_STOCK at a time. Spares count as waste, so a small pool
+// holds none and the default cap is low (-DBUD_STOCK=8 for bursty loads)
+#ifndef BUD_STOCK
+#define BUD_STOCK 2
+#endif
+
+// pages handed back per free_pages_batch() when the pool empties
+#define RELEASEBATCH 64
+
 /************Global Variables*********************************************/
 static kma_page_t* g_page = NULL;
+static kma_page_t* g_stock[BUD_STOCK];
+static int g_stocked = 0;
+static int g_used = 0;
+static int g_batch = 1;
+static int g_batches = 0;
 /************Function Prototypes******************************************/
-void init_page();
-void add_to_free_list(void*, int);
-void* get_free_block(kma_size_t);
-void alloc_page();
-void free_kma_pages();
-void update_bitmap(void*,kma_size_t,int);
-int coalesce(void*,int);
+static void init_page();
+static void add_to_free_list(void*, int);
+static void* get_free_block(kma_size_t);
+static void alloc_page();
+static void free_kma_pages();
+static kma_page_t* stock_page(int);
+static void update_bitmap(void*,kma_size_t,int);
+static int coalesce(void**,int);
+static void print_stats();
+static int page_cmp(const void*, const void*);
 
 /************External Declaration*****************************************/
 
@@ -83,28 +103,27 @@ int coalesce(void*,int);
 void*
 kma_malloc(kma_size_t size)
 {
-    // init global pointer if not already initiliazed
-    if (!g_page) {
-        init_page();
-    }
-    
     // add enough space for a pointer to the size
     size += sizeof(int);
     void* address;
     
     // ensure that there is enough space
-    if (size + sizeof(page_t) + sizeof(kma_page_t) + sizeof(free_list_t) > PAGESIZE) {
+    if (size + sizeof(page_t) + sizeof(free_list_t) > PAGESIZE) {
         
-        //allocate a new page
-        kma_page_t* page = get_page();
-        *((kma_page_t**)page->ptr) = page;
-        if ((size + sizeof(kma_page_t*)) > page->size)
-        {
-            // if size is still larger than size of page, free the page and return null
-            free_page(page);
+        // give it a run of its own
+        int order = page_order(size - sizeof(int));
+        if (order > KPAGE_MAXORDER) {
             return NULL;
         }
-        return page->ptr + sizeof(kma_page_t*);
+        kma_page_t* run = get_pages(order, PAGE_SHORT);
+        page_tag(run, TAG_LARGE);
+        return run->ptr;
+    }
+    
+    // init global pointer if not already initiliazed, only small blocks
+    // live in the pool so only their last free tears it down
+    if (!g_page) {
+        init_page();
     }
     
     // get the address of free block
@@ -130,18 +149,18 @@ kma_malloc(kma_size_t size)
 void
 kma_free(void* ptr, kma_size_t size)
 {
-    free_list_t* list = (free_list_t *)(g_page->ptr + sizeof(page_t));
-    if (size > PAGESIZE-sizeof(page_t)-sizeof(kma_page_t)-sizeof(free_list_t)-sizeof(int)) {
-        kma_page_t* page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
-        free_page(page);
+    // a run of its own, may outlive the pages of the small blocks
+    if (size > PAGESIZE-sizeof(page_t)-sizeof(free_list_t)-sizeof(int)) {
+        free_pages(page_lookup(ptr));
         return;
     }
     
+    free_list_t* list = (free_list_t *)(g_page->ptr + sizeof(page_t));
     ptr = (ptr - sizeof(int));
     int mysize = *((int *) ptr);
     
     update_bitmap(ptr, mysize, 0);
-    mysize = coalesce(ptr,mysize);
+    mysize = coalesce(&ptr,mysize);
     
     add_to_free_list(ptr, mysize);
     
@@ -154,21 +173,50 @@ void
 free_kma_pages()
 {
     page_t* p = g_page->ptr;
-    page_t* next_p;
+    kma_page_t* batch[RELEASEBATCH];
+    int n = 0;
     while (p != NULL) {
-        next_p = p->next;
-        (p->page)->ptr = (void*)p;
-        free_page(p->page);
-        p = next_p;
+        if (n == RELEASEBATCH) {
+            free_pages_batch(n, batch);
+            n = 0;
+        }
+        batch[n++] = page_lookup(p);
+        p = p->next;
     }
+    free_pages_batch(n, batch);
+    
+    // the spares go too, so the page layer sees an empty pool
+    free_pages_batch(g_stocked - g_used, g_stock + g_used);
+    g_stocked = g_used = 0;
+    g_batch = 1;
     g_page = NULL;
 }
 
+kma_page_t*
+stock_page(int tag)
+{
+    int i;
+    
+    // handed out in the order the page layer gave them
+    if (g_used == g_stocked) {
+        get_pages_batch(g_batch, g_stock);
+        g_batches++;
+        for (i = 0; i < g_batch; i++) {
+            page_tag(g_stock[i], TAG_SPARE);
+        }
+        g_stocked = g_batch;
+        g_used = 0;
+        g_batch = (2 * g_batch < BUD_STOCK) ? 2 * g_batch : BUD_STOCK;
+    }
+    page_tag(g_stock[g_used], tag);
+    return g_stock[g_used++];
+}
+
 void*
 get_free_block(kma_size_t size)
 {
     free_list_t* list = (free_list_t*)(g_page->ptr + sizeof(page_t));
-    if (size > list->bufsizes[9]) {
+    if (size > list->bufsizes[NUMCLASSES-1]) {
         return NULL;
     }
     int i=0;
@@ -178,7 +226,7 @@ get_free_block(kma_size_t size)
     int idx = i;
     while (list->lists[i] == NULL) {
         i++;
-        if (i == 10) {
+        if (i == NUMCLASSES) {
             return NULL;
         }
     }
@@ -189,7 +237,7 @@ get_free_block(kma_size_t size)
         
         nextaddr = list->lists[i-1];
         list->lists[i-1] = address;
-        if (i == 9) { // special case, because bufsizes[9] != bufsizes[8]*2
+        if (i == NUMCLASSES-1) { // special case, because the last class is not twice the one before
             *((void**)address) = nextaddr;
         } else {
             *((void**)address) = address + list->bufsizes[i-1];
@@ -209,13 +257,14 @@ get_free_block(kma_size_t size)
 void init_page()
 {
     // calculate the available space
-    int space = (unsigned int)PAGESIZE - sizeof(kma_page_t) - sizeof(page_t) - sizeof(free_list_t);
+    int space = (unsigned int)PAGESIZE - sizeof(page_t) - sizeof(free_list_t);
     
-    // get a new page
-    kma_page_t* new_kma_page = get_page();
+    // get a new page, the free lists make it the bookkeeping page
+    kma_page_t* new_kma_page = stock_page(TAG_META);
     page_t* new_page = (page_t *)(new_kma_page->ptr);
     
-    new_page->page = new_kma_page;
+    // the blocks of a page find its bitmap through page_lookup()
+    new_kma_page->private = new_page;
     new_page->next = NULL;
     g_page = new_kma_page;
     
@@ -224,33 +273,32 @@ void init_page()
     
     int i;
     int size = 16;
-    for(i = 0; i < 10; i++) {
+    for(i = 0; i < NUMCLASSES; i++) {
         list->bufsizes[i] = size;
         list->lists[i] = NULL;
         size *= 2;
     }
-    for (i = 0; i < 128; i++) {
+    for (i = 0; i < sizeof(new_page->bitmap); i++) {
         new_page->bitmap[i] = 0;
     }
-    list->bufsizes[9] = space;
+    list->bufsizes[NUMCLASSES-1] = space;
     void* nextaddr = (void*)new_page + sizeof(page_t) + sizeof(free_list_t);
     
     // add the page to free list
-    add_to_free_list(nextaddr,list->bufsizes[9]);
+    add_to_free_list(nextaddr,list->bufsizes[NUMCLASSES-1]);
 }
 
 void alloc_page()
 {
-    int space = (unsigned int)PAGESIZE - sizeof(kma_page_t) - sizeof(page_t) - sizeof(free_list_t);
+    int space = (unsigned int)PAGESIZE - sizeof(page_t) - sizeof(free_list_t);
     
-    kma_page_t* new_kma_page = get_page();
+    kma_page_t* new_kma_page = stock_page(TAG_DATA);
     page_t* new_page = (page_t *)(new_kma_page->ptr);
-    new_kma_page->ptr = (void*)new_page;
     
-    new_page->page = new_kma_page;
+    new_kma_page->private = new_page;
     new_page->next = NULL;
     int i;
-    for (i = 0; i < 128; i++) {
+    for (i = 0; i < sizeof(new_page->bitmap); i++) {
         new_page->bitmap[i] = 0;
     }
     
@@ -260,7 +308,7 @@ void alloc_page()
     }
     old_page->next = new_page;
     
-    // don't really need to add sizeof(free_list_t), but max. buffer size will be bufsizes[9] regardless so might as well do it for consistency
+    // don't really need to add sizeof(free_list_t), but max. buffer size will be the last class regardless so might as well do it for consistency
     void* startAddr = (void*)(new_page) + sizeof(page_t) + sizeof(free_list_t);
     add_to_free_list(startAddr,space);
 }
@@ -269,7 +317,7 @@ void add_to_free_list (void* addr, int size) // size INCLUDES head ptr
 {
     free_list_t* list = (free_list_t*)(g_page->ptr + sizeof(page_t));
     int i;
-    for (i = 0; i < 10; i ++) {
+    for (i = 0; i < NUMCLASSES; i ++) {
         if (size == list->bufsizes[i]) {
             *((void **)addr) = list->lists[i];
             list->lists[i] = addr;
@@ -281,10 +329,7 @@ void add_to_free_list (void* addr, int size) // size INCLUDES head ptr
 
 void update_bitmap(void* ptr, kma_size_t size, int mem_status) {
     
-    page_t* page = (page_t*)(g_page->ptr);
-    while (ptr < (void*)page || ptr > (void*)page+PAGESIZE-sizeof(kma_page_t)) {
-        page = (page_t*)(page->next);
-    }
+    page_t* page = page_lookup(ptr)->private;
     int offset = (ptr - (void*)page) - sizeof(page_t) - sizeof(free_list_t);
     int i;
     if (mem_status == 1) {
@@ -300,17 +345,17 @@ void update_bitmap(void* ptr, kma_size_t size, int mem_status) {
 }
 
 
-int coalesce(void* ptr, int size) {
+// merges the block at *ptr with its buddy if that is free, and moves
+// *ptr to the start of the merged block
+int coalesce(void** blockptr, int size) {
     
+    void* ptr = *blockptr;
     free_list_t* list = (free_list_t*)(g_page->ptr + sizeof(page_t));
-    if (2*size > list->bufsizes[9]) {
+    if (2*size > list->bufsizes[NUMCLASSES-1]) {
         return size;
     }
     
-    page_t* page = (page_t*)(g_page->ptr);
-    while (ptr < ((void*)page+sizeof(page_t)+sizeof(free_list_t)) || ptr > (void*)page+PAGESIZE-sizeof(kma_page_t)) {
-        page = (page_t*)(page->next);
-    }
+    page_t* page = page_lookup(ptr)->private;
     int offset = (ptr - (void*)page) - sizeof(page_t) - sizeof(free_list_t);
     
     void* oldptr;
@@ -327,26 +372,21 @@ int coalesce(void* ptr, int size) {
     
     for (i=0; i < size/16; i++) {
         
-        int j = 0;
         int k = startbit+i;
-        while (k >= sizeof(char)) {
-            j++;
-            k -= sizeof(char);
-        }
-        if (page->bitmap[j] & (1 << (7 - k)))
+        if (page->bitmap[k/8] & (1 << (7 - (k%8))))
             return size;
     }
     
     for (i=0; list->bufsizes[i] != size; i++) {}
     void* curptr = list->lists[i];
     
-    while (curptr != NULL && curptr > ((void*)page+sizeof(page_t)+sizeof(free_list_t)) && curptr < (void*)page+PAGESIZE-sizeof(kma_page_t)) {
+    while (curptr != NULL && curptr > ((void*)page+sizeof(page_t)+sizeof(free_list_t)) && curptr < (void*)page+PAGESIZE) {
         
         if (*((void**)curptr) == oldptr) {
             *((void**)curptr) = *((void**)oldptr);
             
             if (oldptr < ptr) {
-                ptr = oldptr;
+                *blockptr = oldptr;
             }
             return 2*size;
         }
@@ -355,4 +395,69 @@ int coalesce(void* ptr, int size) {
     return size;
 }
 
+void print_stats()
+{
+    printf("kma_bud Page Batches: %d (up to %d pages each)\n", g_batches, BUD_STOCK);
+}
+
+int page_cmp(const void* a, const void* b)
+{
+    void* pa = *((void**)a);
+    void* pb = *((void**)b);
+    return (pa > pb) - (pa < pb);
+}
+
+void kma_introspect(kma_introspect_t* info)
+{
+    if (!g_page) {
+        return;
+    }
+    free_list_t* list = (free_list_t*)(g_page->ptr + sizeof(page_t));
+    
+    // the pages sorted by address, so free blocks can be charged to theirs
+    int n = 0;
+    page_t* p;
+    for (p = g_page->ptr; p != NULL; p = p->next) {
+        n++;
+    }
+    void** pages = malloc(n * sizeof(void*));
+    int* avail = calloc(n, sizeof(int));
+    n = 0;
+    for (p = g_page->ptr; p != NULL; p = p->next) {
+        pages[n++] = p;
+    }
+    qsort(pages, n, sizeof(void*), page_cmp);
+    
+    int i;
+    for (i = 0; i < NUMCLASSES; i++) {
+        void* curptr;
+        for (curptr = list->lists[i]; curptr != NULL; curptr = *((void**)curptr)) {
+            void* base = BASEADDR(curptr);
+            void** page = bsearch(&base, pages, n, sizeof(void*), page_cmp);
+            avail[page - pages] += list->bufsizes[i];
+            kma_count_extent(info, list->bufsizes[i]);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        kma_count_page(info, avail[i]);
+    }
+    
+    // the spares are unused pages waiting to be handed out
+    for (i = g_used; i < g_stocked; i++) {
+        kma_count_extent(info, PAGESIZE);
+        kma_count_page(info, PAGESIZE);
+    }
+    
+    // every page keeps room for the bitmap and the free lists, every
+    // block carries its size
+    info->meta_bytes = n * (sizeof(page_t) + sizeof(free_list_t))
+        + list->allocs * sizeof(int);
+    
+    free(pages);
+    free(avail);
+}
+
+kma_ops_t kma_bud_ops =
+    { "bud", kma_malloc, kma_free, print_stats, kma_introspect, FALSE };
+
 #endif // KMA_BUD
\ No newline at end of file
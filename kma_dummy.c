@@ -58,8 +58,16 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// every request has a page of its own, the share of it in use
+#define OCCUPANCY(size) \
+  ((((size) + sizeof(kma_page_t*)) * KMA_OCCUPANCY_CLASSES - 1) / PAGESIZE)
+
 /************Global Variables*********************************************/
 
+// pages by occupancy class for kma_introspect(), updated atomically as
+// kma_malloc() and kma_free() may run on several threads at once
+static int g_pages[KMA_OCCUPANCY_CLASSES];
+
 /************Function Prototypes******************************************/
 
 /************External Declaration*****************************************/
@@ -89,6 +97,7 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
+  __atomic_add_fetch(&g_pages[OCCUPANCY(size)], 1, __ATOMIC_RELAXED);
   return page->ptr + sizeof(kma_page_t*);
 }
 
@@ -98,7 +107,26 @@ void kma_free(void* ptr, kma_size_t size)
   
   page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
   
+  __atomic_sub_fetch(&g_pages[OCCUPANCY(size)], 1, __ATOMIC_RELAXED);
   free_page(page);
 }
 
+void kma_introspect(kma_introspect_t* info)
+{
+  int i;
+  
+  for (i = 0; i < KMA_OCCUPANCY_CLASSES; i++)
+    {
+      info->occupancy[i] = g_pages[i];
+      info->num_pages += g_pages[i];
+    }
+  
+  // nothing is free, past the page pointer the rest of a page is
+  // internal fragmentation
+  info->meta_bytes = info->num_pages * sizeof(kma_page_t*);
+}
+
+kma_ops_t kma_dummy_ops =
+  { "dummy", kma_malloc, kma_free, NULL, kma_introspect, TRUE };
+
 #endif // KMA_DUMMY
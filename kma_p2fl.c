@@ -70,4 +70,13 @@ kma_free(void* ptr, kma_size_t size)
   ;
 }
 
+void
+kma_introspect(kma_introspect_t* info)
+{
+  ;
+}
+
+// not implemented yet
+kma_ops_t kma_p2fl_ops = { "p2fl", NULL, NULL, NULL, NULL, FALSE };
+
 #endif // KMA_P2FL
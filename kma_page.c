@@ -45,6 +45,12 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef KPAGE_THREADS
+#include <pthread.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -57,16 +63,196 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* a region is one aligned chunk of MAXPAGES pages carved out of the
+ * system; the pool is the set of live regions. A buddy allocator hands
+ * out runs of 2^order pages of a region. Free runs sit on a list per
+ * order and lifetime class, kept in side tables so their memory can be
+ * given back to the system while they are free: linked lists for
+ * KPAGE_LIFO, bitmaps with a bit per frame for KPAGE_LOWEST. The class
+ * of a run is the class of the pageblock it starts in. */
+typedef struct
+{
+  void* base;
+  kma_page_t* frames; // descriptor table, one per page of the region
+#if KPAGE_POLICY == KPAGE_LOWEST
+  unsigned long* free_map; // bit set at the first frame of a free run
+  int map_hint[PAGE_LIFETIMES][KPAGE_MAXORDER + 1]; // no bits in words below
+#else
+  int* free_next;     // free list links, set at the first frame of a free run
+  int* free_prev;
+  int free_head[PAGE_LIFETIMES][KPAGE_MAXORDER + 1];
+#endif
+  signed char* free_order; // order of the free run starting here, else -1
+  char* block_type;   // lifetime class of each pageblock
+  int num_free_runs[KPAGE_MAXORDER + 1];
+  char* unreleased;   // freed frames still resident (KPAGE_MMAP only)
+  int backing;        // what the system actually gave us
+  int next_unused;    // frames at and above it were never handed out
+  int num_in_use;
+  bool idle;          // empty and waiting for the retention window to pass
+  bool warm;          // prefaulted by page_warm(), kept resident
+  long idle_op;       // page operation count when it went idle
+  long idle_usec;     // time when it went idle
+} kma_region_t;
+
+#define REGIONSIZE ((long) MAXPAGES * PAGESIZE)
+
+#define NUMBLOCKS (MAXPAGES >> KPAGE_BLOCK_ORDER)
+
+#define MAPBITS (8 * sizeof(unsigned long))
+#define MAPWORDS (MAXPAGES / MAPBITS)
+
+/* the free bitmap of a class and order */
+#define FREE_MAP(i, type, order) \
+  (regions[i].free_map + ((type) * (KPAGE_MAXORDER + 1) + (order)) * MAPWORDS)
+
+#if KPAGE_POLICY == KPAGE_LOWEST
+#define LISTMETA \
+  (PAGE_LIFETIMES * (KPAGE_MAXORDER + 1) * MAPWORDS * sizeof(unsigned long))
+#else
+#define LISTMETA (MAXPAGES * 2 * sizeof(int))
+#endif
+
+#ifdef KPAGE_MMAP
+#define REGIONMETA (MAXPAGES * (sizeof(kma_page_t) + 2) + LISTMETA + NUMBLOCKS)
+#else
+#define REGIONMETA (MAXPAGES * (sizeof(kma_page_t) + 1) + LISTMETA + NUMBLOCKS)
+#endif
+
+/* a page frame number names a page by its region and index in it, it is
+ * also the id of the page descriptor */
+#define PFN(region, frame) ((region) * MAXPAGES + (frame))
+#define PFN_REGION(pfn) ((pfn) / MAXPAGES)
+#define PFN_FRAME(pfn) ((pfn) % MAXPAGES)
+#define PFN_ADDR(pfn) \
+  (regions[PFN_REGION(pfn)].base + (long) PFN_FRAME(pfn) * PAGESIZE)
+#define PFN_DESC(pfn) (&regions[PFN_REGION(pfn)].frames[PFN_FRAME(pfn)])
+
+/* unreleased[] of a free frame with KPAGE_SCAVENGE: freed since the last
+ * scavenger pass, or already free at that pass and released at the next */
+#define RELEASE_FRESH 1
+#define RELEASE_AGED 2
+
+/* lifetime class of the run starting at a frame */
+#define RUN_TYPE(i, frame) \
+  (regions[i].block_type[(frame) >> KPAGE_BLOCK_ORDER])
+
+/* single pages kept in front of the buddy allocator, one for the pool or
+ * one per thread with KPAGE_THREADS; the counters are only used then,
+ * written by their thread alone and added up by page_stats() */
+typedef struct kma_cache
+{
+  int pfns[KPAGE_CACHE_SIZE];
+  int count;
+  int num_requested;
+  int num_freed;
+  struct kma_cache* next;
+} kma_cache_t;
+
+#ifdef KPAGE_THREADS
+/* single pages also move between the caches through a stack that takes
+ * no lock, kept in front of the buddy allocator. Its head packs the top
+ * page frame number (plus one, 0 is empty) with a tag bumped on every
+ * change, so a compare-and-swap cannot be fooled by a page that was
+ * popped and pushed back in between (ABA) */
+#define HEAD_PFN(h) ((int)((h) & 0xffffffffUL) - 1)
+#define HEAD_TAG(h) ((h) >> 32)
+#define MAKE_HEAD(pfn, tag) \
+  (((unsigned long)(tag) << 32) | (unsigned int)((pfn) + 1))
+
+#define LOCK() pthread_mutex_lock(&pool_lock)
+#define UNLOCK() pthread_mutex_unlock(&pool_lock)
+#define ATOMIC_ADD(x, n) __atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+#define ATOMIC_READ(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#else
+#define LOCK()
+#define UNLOCK()
+#define ATOMIC_ADD(x, n) ((x) += (n))
+#define ATOMIC_READ(x) (x)
+#endif
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE, 0, 0, 0, 0 };
+
+static kma_region_t regions[MAXREGIONS];
 
-static void* pool = NULL;
-static void* next_free_page = NULL;
+static char* backing_names[] = { "heap", "mmap", "thp", "hugetlb" };
+
+static char* tag_names[] = { "none", "data", "meta", "large", "spare" };
+
+// tagged pages only; frees take them off without the pool lock
+static kma_tag_stat_t tag_stats[PAGE_TAGS];
+
+static int num_idle = 0;
+static long num_ops = 0;
+
+#if defined(KPAGE_MMAP) && KPAGE_RELEASE_BATCH > 1
+static void* pending_release[KPAGE_RELEASE_BATCH];
+static int num_pending = 0;
+#endif
+
+#ifdef KPAGE_THREADS
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread kma_cache_t* cache = NULL;
+static kma_cache_t* caches = NULL;
+static unsigned long free_head = 0;
+static int free_next[PFN(MAXREGIONS, 0)]; // the page below on the stack
+static int num_stacked = 0;
+#else
+static kma_cache_t cache;
+#endif
+
+#ifdef KPAGE_SCAVENGE
+static int zero_pfns[KPAGE_ZERO_PAGES]; // zeroed by the scavenger
+static int num_zero = 0;
+static bool scavenger_started = FALSE;
+#endif
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
-void initPages();
+kma_page_t* initPage(int, int);
+void untagPage(kma_page_t*);
+int allocPages(int, int);
+void freePages(int, int);
+int allocRun(int, int, int);
+int splitRun(int, int, int, int);
+void freeRun(int, int, int);
+void claimBlocks(int, int, int, int);
+int firstRun(int, int, int);
+void linkRun(int, int, int);
+void unlinkRun(int, int, int);
+void cachePage(kma_cache_t*, int);
+int initRegion();
+void freeRegion(int);
+void warmRegion(int);
+int findRegion(void*);
+void* mapRegion(int*);
+void unmapRegion(void*);
+void releasePages(int, int, int);
+void flushReleases();
+void* reserveRegion(long);
+int comparePages(const void*, const void*);
+void idleRegion(int);
+void reapRegions();
+long nowUsec();
+kma_cache_t* threadCache();
+void refillCache(kma_cache_t*);
+void spillCache(kma_cache_t*, int);
+void drainCache(kma_cache_t*, int);
+void idlePool();
+#ifdef KPAGE_THREADS
+bool pushFrame(int);
+int popFrame();
+void initCacheKey();
+void freeCache(void*);
+#endif
+#ifdef KPAGE_SCAVENGE
+void startScavenger();
+void* scavenge(void*);
+void scavengeRegion(int);
+void growPool();
+#endif
 
 /************External Declaration*****************************************/
 
@@ -75,106 +261,1689 @@ void initPages();
 kma_page_t*
 get_page()
 {
-  static int id = 0;
-  kma_page_t* res;
+  kma_cache_t* c = threadCache();
+  
+#ifndef KPAGE_THREADS
+  num_ops++;
+  reapRegions();
   
   kma_page_stats.num_requested++;
   kma_page_stats.num_in_use++;
+#endif
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  if (c->count == 0)
+    {
+      refillCache(c);
+    }
   
-  assert(res->ptr != NULL);
+#ifdef KPAGE_THREADS
+  ATOMIC_ADD(c->num_requested, 1);
+#endif
   
-  return res;	
+  return initPage(c->pfns[--c->count], 0);
 }
 
 void
 free_page(kma_page_t* ptr)
 {
+  kma_cache_t* c;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
+  
+  if (ptr->size != PAGESIZE)
+    {
+      // a run from get_pages()
+      free_pages(ptr);
+      return;
+    }
+  
+  assert(ptr->id >= 0 && ptr->id < PFN(MAXREGIONS, 0));
+  assert(ptr == PFN_DESC(ptr->id));
+  
+  untagPage(ptr);
+  
+  // a free frame has no page pointer, page_lookup() relies on that
+  ptr->ptr = NULL;
+  
+  c = threadCache();
+  if (c->count == KPAGE_CACHE_SIZE)
+    {
+      spillCache(c, KPAGE_CACHE_BATCH);
+    }
+  cachePage(c, ptr->id);
+  
+#ifdef KPAGE_THREADS
+  ATOMIC_ADD(c->num_freed, 1);
+#else
   assert(kma_page_stats.num_in_use > 0);
   
+  num_ops++;
   kma_page_stats.num_freed++;
   kma_page_stats.num_in_use--;
   
-  freePage(ptr->ptr);
-  free(ptr);
+  if (kma_page_stats.num_in_use == 0)
+    {
+      idlePool();
+    }
+  
+  reapRegions();
+#endif
+}
+
+kma_page_t*
+get_pages(int order, int lifetime)
+{
+  int pfn;
+  
+  assert(order >= 0 && order <= KPAGE_MAXORDER);
+  assert(lifetime >= 0 && lifetime < PAGE_LIFETIMES);
+  
+  LOCK();
+  num_ops++;
+  reapRegions();
+  
+  kma_page_stats.num_requested += 1 << order;
+  kma_page_stats.num_in_use += 1 << order;
+  
+  pfn = allocPages(order, KPAGE_GROUPING ? lifetime : PAGE_LONG);
+  UNLOCK();
+  
+  return initPage(pfn, order);
+}
+
+void
+free_pages(kma_page_t* ptr)
+{
+  int order;
+  
+  assert(ptr != NULL);
+  assert(ptr->ptr != NULL);
+  
+  assert(ptr->id >= 0 && ptr->id < PFN(MAXREGIONS, 0));
+  assert(ptr == PFN_DESC(ptr->id));
+  
+  order = page_order(ptr->size);
+  assert(ptr->size == PAGESIZE << order);
+  
+  untagPage(ptr);
+  
+  // a free frame has no page pointer, page_lookup() relies on that
+  ptr->ptr = NULL;
+  
+  LOCK();
+#ifndef KPAGE_THREADS
+  assert(kma_page_stats.num_in_use >= 1 << order);
+#endif
+  
+  num_ops++;
+  kma_page_stats.num_freed += 1 << order;
+  kma_page_stats.num_in_use -= 1 << order;
+  
+  freePages(ptr->id, order);
+  
+#ifndef KPAGE_THREADS
+  if (kma_page_stats.num_in_use == 0)
+    {
+      idlePool();
+    }
+#endif
+  
+  reapRegions();
+  UNLOCK();
+}
+
+kma_page_t*
+get_zeroed_page()
+{
+  kma_page_t* res;
+  
+#ifdef KPAGE_SCAVENGE
+  int pfn = -1;
+  
+  LOCK();
+  if (num_zero > 0)
+    {
+      pfn = zero_pfns[--num_zero];
+      kma_page_stats.num_zero_hits++;
+      kma_page_stats.num_requested++;
+      kma_page_stats.num_in_use++;
+    }
+  UNLOCK();
+  
+  if (pfn >= 0)
+    {
+      return initPage(pfn, 0);
+    }
+#endif
+  
+  res = get_page();
+  memset(res->ptr, 0, PAGESIZE);
+  
+  LOCK();
+  kma_page_stats.num_zero_misses++;
+  UNLOCK();
+  
+  return res;
+}
+
+void
+get_pages_batch(int n, kma_page_t** pages)
+{
+  kma_cache_t* c = threadCache();
+  int i = 0;
+  
+  assert(n >= 0);
+  
+#ifndef KPAGE_THREADS
+  num_ops++;
+  reapRegions();
+  
+  kma_page_stats.num_requested += n;
+  kma_page_stats.num_in_use += n;
+#endif
+  
+  while (i < n && c->count > 0)
+    {
+      pages[i++] = initPage(c->pfns[--c->count], 0);
+    }
+  
+#ifdef KPAGE_THREADS
+  int pfn;
+  
+  while (i < n && (pfn = popFrame()) >= 0)
+    {
+      pages[i++] = initPage(pfn, 0);
+    }
+#endif
+  
+  if (i < n)
+    {
+      // the rest straight from the regions under one lock
+      LOCK();
+      while (i < n)
+	{
+	  pages[i++] = initPage(allocPages(0, PAGE_LONG), 0);
+	}
+      UNLOCK();
+    }
+  
+#ifdef KPAGE_THREADS
+  ATOMIC_ADD(c->num_requested, n);
+#endif
+}
+
+void
+free_pages_batch(int n, kma_page_t** pages)
+{
+  kma_cache_t* c = threadCache();
+  int i;
+  
+  for (i = 0; i < n; i++)
+    {
+      assert(pages[i] != NULL);
+      assert(pages[i]->ptr != NULL);
+      assert(pages[i]->size == PAGESIZE);
+      assert(pages[i] == PFN_DESC(pages[i]->id));
+  
+      untagPage(pages[i]);
+  
+      // a free frame has no page pointer, page_lookup() relies on that
+      pages[i]->ptr = NULL;
+    }
+  
+  // the cache takes what fits, the rest goes back under one lock
+  for (i = 0; i < n && c->count < KPAGE_CACHE_SIZE; i++)
+    {
+      cachePage(c, pages[i]->id);
+    }
+  
+#ifdef KPAGE_THREADS
+  while (i < n && pushFrame(pages[i]->id))
+    {
+      i++;
+    }
+#endif
+  
+  if (i < n)
+    {
+      LOCK();
+      while (i < n)
+	{
+	  freePages(pages[i++]->id, 0);
+	}
+      UNLOCK();
+    }
+  
+#ifdef KPAGE_THREADS
+  ATOMIC_ADD(c->num_freed, n);
+#else
+  assert(kma_page_stats.num_in_use >= n);
+  
+  num_ops++;
+  kma_page_stats.num_freed += n;
+  kma_page_stats.num_in_use -= n;
+  
+  if (kma_page_stats.num_in_use == 0)
+    {
+      idlePool();
+    }
+  
+  reapRegions();
+#endif
+}
+
+int
+page_order(int size)
+{
+  int order = 0;
+  
+  while ((PAGESIZE << order) < size)
+    {
+      order++;
+    }
+  
+  return order;
 }
 
 kma_page_stat_t*
 page_stats()
 {
   static kma_page_stat_t stats;
+  int i;
+  
+  LOCK();
+  memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  
+#ifdef KPAGE_THREADS
+  kma_cache_t* c;
+  
+  for (c = caches; c != NULL; c = c->next)
+    {
+      stats.num_requested += ATOMIC_READ(c->num_requested);
+      stats.num_freed += ATOMIC_READ(c->num_freed);
+    }
+  stats.num_in_use = stats.num_requested - stats.num_freed;
+#endif
+  
+  for (i = 0; i < MAXREGIONS; i++)
+    {
+      stats.regions[i].base = regions[i].base;
+      stats.regions[i].num_pages = (regions[i].base == NULL) ? 0 : MAXPAGES;
+      stats.regions[i].num_in_use = regions[i].num_in_use;
+      stats.regions[i].num_touched = regions[i].next_unused;
+      stats.regions[i].backing = regions[i].backing;
+    }
+  UNLOCK();
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  return &stats;
 }
 
-void*
-allocPage()
+kma_free_run_stat_t*
+page_free_runs()
 {
-  void* res;
+  static kma_free_run_stat_t stats;
+  int i, order;
+  
+  LOCK();
+  stats.largest_free_run = 0;
+  for (order = 0; order <= KPAGE_MAXORDER; order++)
+    {
+      stats.free_runs[order] = 0;
+      for (i = 0; i < MAXREGIONS; i++)
+	{
+	  stats.free_runs[order] += regions[i].num_free_runs[order];
+	}
+  
+      if (stats.free_runs[order] > 0)
+	{
+	  stats.largest_free_run = 1 << order;
+	}
+    }
+  UNLOCK();
   
-  if (pool == NULL)
+  return &stats;
+}
+
+void
+page_stats_reset()
+{
+  kma_cache_t* c = threadCache();
+  int i, tag;
+  
+  assert(page_stats()->num_in_use == 0);
+  
+  LOCK();
+  if (num_idle > 0)
     {
-      initPages();
+      drainCache(c, c->count);
+      for (i = 0; i < MAXREGIONS; i++)
+	{
+	  if (regions[i].base != NULL && regions[i].idle && !regions[i].warm)
+	    {
+	      freeRegion(i);
+	    }
+	}
     }
   
-  res = next_free_page;
+  // what the pool holds now stays, the rest counts from here
+  kma_page_stat_t kept = kma_page_stats;
+  memset(&kma_page_stats, 0, sizeof(kma_page_stat_t));
+  kma_page_stats.page_size = PAGESIZE;
+  kma_page_stats.num_regions = kept.num_regions;
+  kma_page_stats.max_regions = kept.num_regions;
+  kma_page_stats.num_meta_bytes = kept.num_meta_bytes;
+  kma_page_stats.backing = kept.backing;
+  kma_page_stats.num_warm = kept.num_warm;
   
-  if (res == NULL)
+#ifdef KPAGE_THREADS
+  for (c = caches; c != NULL; c = c->next)
     {
-      error("error: all pages already allocated", "");
+      c->num_requested = 0;
+      c->num_freed = 0;
+    }
+#endif
+  
+  for (tag = 0; tag < PAGE_TAGS; tag++)
+    {
+      tag_stats[tag].max_in_use = tag_stats[tag].num_in_use;
+      tag_stats[tag].num_tagged = 0;
+    }
+  UNLOCK();
+}
+
+void
+page_tag(kma_page_t* page, int tag)
+{
+  int n = page->size / PAGESIZE;
+  int in_use;
+  
+  assert(page->ptr != NULL);
+  assert(tag >= 0 && tag < PAGE_TAGS);
+  
+  if (tag == page->tag)
+    {
+      return;
+    }
+  
+  untagPage(page);
+  if (tag == TAG_NONE)
+    {
+      return;
+    }
+  
+  page->tag = tag;
+  
+  // the peak only moves here, so the lock keeps it exact
+  LOCK();
+  in_use = ATOMIC_ADD(tag_stats[tag].num_in_use, n);
+  if (in_use > tag_stats[tag].max_in_use)
+    {
+      tag_stats[tag].max_in_use = in_use;
+    }
+  tag_stats[tag].num_tagged += n;
+  UNLOCK();
+}
+
+kma_tag_stat_t*
+page_tag_stats()
+{
+  static kma_tag_stat_t stats[PAGE_TAGS];
+  int num_in_use, tag;
+  
+  // the counters alone, not a page_stats() copy: the harness asks
+  // after every trace line
+  LOCK();
+#ifdef KPAGE_THREADS
+  kma_cache_t* c;
+  
+  num_in_use = kma_page_stats.num_requested - kma_page_stats.num_freed;
+  for (c = caches; c != NULL; c = c->next)
+    {
+      num_in_use += ATOMIC_READ(c->num_requested) - ATOMIC_READ(c->num_freed);
+    }
+#else
+  num_in_use = kma_page_stats.num_in_use;
+#endif
+  
+  for (tag = 0; tag < PAGE_TAGS; tag++)
+    {
+      stats[tag].num_in_use = ATOMIC_READ(tag_stats[tag].num_in_use);
+      stats[tag].max_in_use = tag_stats[tag].max_in_use;
+      stats[tag].num_tagged = tag_stats[tag].num_tagged;
+      num_in_use -= (tag == TAG_NONE) ? 0 : stats[tag].num_in_use;
+    }
+  UNLOCK();
+  
+  stats[TAG_NONE].num_in_use = num_in_use;
+  
+  return stats;
+}
+
+char*
+page_tag_name(int tag)
+{
+  assert(tag >= 0 && tag < PAGE_TAGS);
+  
+  return tag_names[tag];
+}
+
+/* take a page being freed (or tagged again) off the count of its tag */
+void
+untagPage(kma_page_t* page)
+{
+  if (page->tag != TAG_NONE)
+    {
+      ATOMIC_ADD(tag_stats[page->tag].num_in_use, -(page->size / PAGESIZE));
+      page->tag = TAG_NONE;
     }
+}
+
+/* fill in the descriptor of a run that was just allocated */
+kma_page_t*
+initPage(int pfn, int order)
+{
+  kma_page_t* res = PFN_DESC(pfn);
   
-  next_free_page = *((void**)next_free_page);
+  res->id = pfn;
+  res->size = PAGESIZE << order;
+  res->ptr = PFN_ADDR(pfn);
+  res->tag = TAG_NONE;
+  res->private = NULL;
   
-  assert(res != NULL);
+  assert(res->ptr != NULL);
   
   return res;
 }
 
+/* a run of 2^order pages of the given class, the pool lock is held */
+int
+allocPages(int order, int type)
+{
+  int i, frame = -1;
+  
+  // prefer the lowest region with a fitting run so that the upper
+  // regions drain and can be released
+  for (i = 0; i < MAXREGIONS; i++)
+    {
+      if (regions[i].base != NULL && (frame = allocRun(i, order, type)) >= 0)
+	{
+	  break;
+	}
+    }
+  
+  if (frame < 0)
+    {
+      i = initRegion();
+      frame = allocRun(i, order, type);
+      assert(frame >= 0);
+    }
+  
+#ifdef KPAGE_MMAP
+  // still resident frames drop out of a pending release batch
+  memset(regions[i].unreleased + frame, FALSE, 1 << order);
+#endif
+  
+  regions[i].num_in_use += 1 << order;
+  if (frame + (1 << order) > regions[i].next_unused)
+    {
+      regions[i].next_unused = frame + (1 << order);
+    }
+  
+  if (regions[i].idle)
+    {
+      // picked up again inside its retention window
+      regions[i].idle = FALSE;
+      num_idle--;
+      kma_page_stats.num_region_revivals++;
+    }
+  
+  return PFN(i, frame);
+}
+
+/* give a run back, the pool lock is held */
 void
-freePage(void* ptr)
+freePages(int pfn, int order)
 {
-  assert(ptr != NULL);
+  int i = PFN_REGION(pfn);
+  
+  if (regions[i].base == NULL)
+    {
+      error("error: page does not belong to the pool", "");
+    }
+  assert(regions[i].num_in_use >= 1 << order);
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  regions[i].num_in_use -= 1 << order;
   
-  if (kma_page_stats.num_in_use == 0)
+#ifdef KPAGE_MMAP
+  releasePages(i, PFN_FRAME(pfn), 1 << order);
+#endif
+  
+  freeRun(i, PFN_FRAME(pfn), order);
+  
+#ifndef KPAGE_THREADS
+  if (KPAGE_SHRINK && regions[i].num_in_use == 0)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      idleRegion(i);
     }
+#endif
 }
 
+/* fill an empty cache with a batch, from the stack while it has pages
+ * and then from the regions under one lock */
 void
-initPages()
+refillCache(kma_cache_t* c)
 {
-  int i;
+#ifdef KPAGE_THREADS
+  int pfn;
   
-  assert(next_free_page == NULL);
-  assert(pool == NULL);
+  while (c->count < KPAGE_CACHE_BATCH && (pfn = popFrame()) >= 0)
+    {
+      cachePage(c, pfn);
+    }
+#endif
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  if (c->count < KPAGE_CACHE_BATCH)
+    {
+      LOCK();
+      while (c->count < KPAGE_CACHE_BATCH)
+	{
+	  cachePage(c, allocPages(0, PAGE_LONG));
+	}
+      UNLOCK();
+    }
+}
+
+/* give the n oldest pages of a full cache back, onto the stack while it
+ * has room and the rest to the regions under one lock */
+void
+spillCache(kma_cache_t* c, int n)
+{
+  int j = 0;
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+#ifdef KPAGE_THREADS
+  while (j < n && pushFrame(c->pfns[j]))
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
-      
-      *((void**) ptr) = next;
+      j++;
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  c->count -= j;
+  memmove(c->pfns, c->pfns + j, c->count * sizeof(int));
+#endif
+  
+  if (j < n)
+    {
+      LOCK();
+      drainCache(c, n - j);
+      UNLOCK();
+    }
+}
+
+/* give the n oldest pages of a cache (the n highest with KPAGE_LOWEST)
+ * back to the regions, the pool lock is held */
+void
+drainCache(kma_cache_t* c, int n)
+{
+  int j;
+  
+  assert(n <= c->count);
+  
+  for (j = 0; j < n; j++)
+    {
+      freePages(c->pfns[j], 0);
+    }
+  
+  c->count -= n;
+  memmove(c->pfns, c->pfns + n, c->count * sizeof(int));
+}
+
+/* take a run of 2^order frames out of region i, -1 if it has none */
+int
+allocRun(int i, int order, int type)
+{
+  int o, t, frame;
+  
+  // the smallest fitting run of the same class
+  for (o = order; o <= KPAGE_MAXORDER; o++)
+    {
+      frame = firstRun(i, type, o);
+      if (frame >= 0)
+	{
+	  unlinkRun(i, frame, type);
+	  return splitRun(i, frame, o, order);
+	}
+    }
+  
+  // otherwise the largest run of another class, taking as much of its
+  // pageblock along as possible so the next fallback is far off
+  for (o = KPAGE_MAXORDER; o >= order; o--)
+    {
+      for (t = 0; t < PAGE_LIFETIMES; t++)
+	{
+	  frame = (t == type) ? -1 : firstRun(i, t, o);
+	  if (frame >= 0)
+	    {
+	      unlinkRun(i, frame, t);
+	      claimBlocks(i, frame, o, type);
+	      kma_page_stats.num_fallbacks++;
+	      return splitRun(i, frame, o, order);
+	    }
+	}
+    }
+  
+  return -1;
+}
+
+/* cut a free run of 2^from frames down to 2^to, the upper halves go
+ * back on the free lists */
+int
+splitRun(int i, int frame, int from, int to)
+{
+  while (from > to)
+    {
+      from--;
+      linkRun(i, frame + (1 << from), from);
+    }
+  
+  return frame;
+}
+
+/* free a run, merging it with its buddy as long as that is free too */
+void
+freeRun(int i, int frame, int order)
+{
+  kma_region_t* r = &regions[i];
+  int buddy, block;
+  
+  while (order < KPAGE_MAXORDER)
+    {
+      buddy = frame ^ (1 << order);
+      if (r->free_order[buddy] != order)
+	{
+	  break;
+	}
+  
+      unlinkRun(i, buddy, RUN_TYPE(i, buddy));
+      frame &= buddy;
+      order++;
+    }
+  
+  // a run over several pageblocks keeps them in one class
+  for (block = (frame >> KPAGE_BLOCK_ORDER) + 1;
+       block < (frame + (1 << order)) >> KPAGE_BLOCK_ORDER; block++)
+    {
+      r->block_type[block] = RUN_TYPE(i, frame);
+    }
+  
+  linkRun(i, frame, order);
+}
+
+/* a run taken over from another class: the pageblocks it spans change
+ * class, and one of at least half a pageblock takes its pageblock along
+ * with the free runs left in there */
+void
+claimBlocks(int i, int frame, int order, int type)
+{
+  kma_region_t* r = &regions[i];
+  int block = frame >> KPAGE_BLOCK_ORDER;
+  int j, o, old;
+  
+  if (order >= KPAGE_BLOCK_ORDER)
+    {
+      memset(r->block_type + block, type, 1 << (order - KPAGE_BLOCK_ORDER));
+      return;
+    }
+  
+  if (order < KPAGE_BLOCK_ORDER / 2)
+    {
+      return;
+    }
+  
+  old = r->block_type[block];
+  r->block_type[block] = type;
+  
+  for (j = block << KPAGE_BLOCK_ORDER; j < (block + 1) << KPAGE_BLOCK_ORDER;
+       j += 1 << o)
+    {
+      o = r->free_order[j];
+      if (o < 0)
+	{
+	  o = 0;
+	  continue;
+	}
+  
+      unlinkRun(i, j, old);
+      linkRun(i, j, o);
+    }
+}
+
+/* the run a list hands out next: the one freed last or, with
+ * KPAGE_LOWEST, the lowest; -1 if the list is empty */
+int
+firstRun(int i, int type, int order)
+{
+#if KPAGE_POLICY == KPAGE_LOWEST
+  unsigned long* map = FREE_MAP(i, type, order);
+  int* hint = &regions[i].map_hint[type][order];
+  
+  for (; *hint < MAPWORDS; (*hint)++)
+    {
+      if (map[*hint] != 0)
+	{
+	  return *hint * MAPBITS + __builtin_ctzl(map[*hint]);
+	}
+    }
+  
+  return -1;
+#else
+  return regions[i].free_head[type][order];
+#endif
+}
+
+/* put a free run on the list of its order and class */
+void
+linkRun(int i, int frame, int order)
+{
+  kma_region_t* r = &regions[i];
+  int type = RUN_TYPE(i, frame);
+  
+#if KPAGE_POLICY == KPAGE_LOWEST
+  int word = frame / MAPBITS;
+  
+  FREE_MAP(i, type, order)[word] |= 1UL << (frame % MAPBITS);
+  if (word < r->map_hint[type][order])
+    {
+      r->map_hint[type][order] = word;
+    }
+#else
+  int next = r->free_head[type][order];
+  
+  r->free_prev[frame] = -1;
+  r->free_next[frame] = next;
+  if (next >= 0)
+    {
+      r->free_prev[next] = frame;
+    }
+  r->free_head[type][order] = frame;
+#endif
+  
+  r->free_order[frame] = order;
+  r->num_free_runs[order]++;
+}
+
+/* take a free run off its list, type is the class of that list */
+void
+unlinkRun(int i, int frame, int type)
+{
+  kma_region_t* r = &regions[i];
+  int order = r->free_order[frame];
+  
+  assert(order >= 0);
+  
+#if KPAGE_POLICY == KPAGE_LOWEST
+  assert(FREE_MAP(i, type, order)[frame / MAPBITS] & (1UL << (frame % MAPBITS)));
+  FREE_MAP(i, type, order)[frame / MAPBITS] &= ~(1UL << (frame % MAPBITS));
+#else
+  int prev = r->free_prev[frame];
+  int next = r->free_next[frame];
+  
+  if (prev >= 0)
+    {
+      r->free_next[prev] = next;
+    }
+  else
+    {
+      assert(r->free_head[type][order] == frame);
+      r->free_head[type][order] = next;
+    }
+  if (next >= 0)
+    {
+      r->free_prev[next] = prev;
+    }
+#endif
+  
+  r->free_order[frame] = -1;
+  r->num_free_runs[order]--;
+}
+
+/* keep a single page in a cache; with KPAGE_LOWEST the cache is sorted
+ * from high to low so the lowest page goes out first */
+void
+cachePage(kma_cache_t* c, int pfn)
+{
+  assert(c->count < KPAGE_CACHE_SIZE);
+  
+#if KPAGE_POLICY == KPAGE_LOWEST
+  int j;
+  
+  for (j = c->count; j > 0 && c->pfns[j - 1] < pfn; j--)
+    {
+      c->pfns[j] = c->pfns[j - 1];
+    }
+  c->pfns[j] = pfn;
+  c->count++;
+#else
+  c->pfns[c->count++] = pfn;
+#endif
+}
+
+#ifdef KPAGE_THREADS
+
+/* push a single page onto the stack, FALSE when it holds
+ * KPAGE_STACK_SIZE pages already (the page then goes to the regions, so
+ * the buddy allocator still sees enough free pages to merge runs) */
+bool
+pushFrame(int pfn)
+{
+  unsigned long old;
+  
+  if (ATOMIC_ADD(num_stacked, 1) > KPAGE_STACK_SIZE)
+    {
+      ATOMIC_ADD(num_stacked, -1);
+      return FALSE;
+    }
+  
+  old = __atomic_load_n(&free_head, __ATOMIC_ACQUIRE);
+  do
+    {
+      free_next[pfn] = HEAD_PFN(old);
+    }
+  while (!__atomic_compare_exchange_n(&free_head, &old,
+				      MAKE_HEAD(pfn, HEAD_TAG(old) + 1), TRUE,
+				      __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  
+  return TRUE;
+}
+
+/* pop the top page off the stack, -1 if it is empty */
+int
+popFrame()
+{
+  unsigned long old = __atomic_load_n(&free_head, __ATOMIC_ACQUIRE);
+  int pfn;
+  
+  do
+    {
+      pfn = HEAD_PFN(old);
+      if (pfn < 0)
+	{
+	  return -1;
+	}
+    }
+  while (!__atomic_compare_exchange_n(&free_head, &old,
+				      MAKE_HEAD(free_next[pfn],
+						HEAD_TAG(old) + 1), TRUE,
+				      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  
+  ATOMIC_ADD(num_stacked, -1);
+  return pfn;
+}
+
+kma_cache_t*
+threadCache()
+{
+  if (cache == NULL)
+    {
+      pthread_once(&cache_once, initCacheKey);
+  
+      cache = calloc(1, sizeof(kma_cache_t));
+      if (cache == NULL)
+	{
+	  error("unable to allocate a page cache", "");
+	}
+  
+      LOCK();
+      cache->next = caches;
+      caches = cache;
+      UNLOCK();
+  
+      pthread_setspecific(cache_key, cache);
+    }
+  
+  return cache;
+}
+
+void
+initCacheKey()
+{
+  pthread_key_create(&cache_key, freeCache);
+}
+
+/* thread exit: return the cached pages and keep the thread's counts */
+void
+freeCache(void* arg)
+{
+  kma_cache_t* c = arg;
+  kma_cache_t** prev;
+  
+  LOCK();
+  drainCache(c, c->count);
+  
+  kma_page_stats.num_requested += c->num_requested;
+  kma_page_stats.num_freed += c->num_freed;
+  kma_page_stats.num_in_use += c->num_requested - c->num_freed;
+  
+  for (prev = &caches; *prev != c; prev = &(*prev)->next)
+    ;
+  *prev = c->next;
+  UNLOCK();
+  
+  free(c);
+}
+
+#else // KPAGE_THREADS
+
+kma_cache_t*
+threadCache()
+{
+  return &cache;
+}
+
+#endif // KPAGE_THREADS
+
+#ifdef KPAGE_SCAVENGE
+
+/* the pool lock is held */
+void
+startScavenger()
+{
+  pthread_t tid;
+  
+  if (pthread_create(&tid, NULL, scavenge, NULL) != 0)
+    {
+      error("unable to start the scavenger", "");
+    }
+  pthread_detach(tid);
+  scavenger_started = TRUE;
+}
+
+/* the scavenger thread: every period it releases the pages that stayed
+ * free, grows the pool if it runs low and tops up the zeroed pages.
+ * Pages are zeroed outside the lock, they are taken out of the pool
+ * before and only show up in the reservoir after */
+void*
+scavenge(void* arg)
+{
+  struct timespec period = { KPAGE_SCAVENGE_USEC / 1000000,
+			     (KPAGE_SCAVENGE_USEC % 1000000) * 1000 };
+  int pfns[KPAGE_ZERO_PAGES];
+  int i, n;
+  
+  for (;;)
+    {
+      nanosleep(&period, NULL);
+      
+      LOCK();
+      for (i = 0; i < MAXREGIONS; i++)
+	{
+	  if (regions[i].base != NULL)
+	    {
+	      scavengeRegion(i);
+	    }
+	}
+      
+      growPool();
+      
+      // only this thread adds to the reservoir, so it can only shrink
+      // while the lock is dropped
+      for (n = 0; num_zero + n < KPAGE_ZERO_PAGES; n++)
+	{
+	  pfns[n] = allocPages(0, PAGE_LONG);
+	}
+      UNLOCK();
+      
+      for (i = 0; i < n; i++)
+	{
+	  memset(PFN_ADDR(pfns[i]), 0, PAGESIZE);
+	}
+      
+      LOCK();
+      for (i = 0; i < n; i++)
+	{
+	  zero_pfns[num_zero++] = pfns[i];
+	}
+      kma_page_stats.num_prezeroed += n;
+      UNLOCK();
+    }
+  
+  return NULL;
+}
+
+/* release the frames of a region that were free at the last pass and
+ * still are, merging neighbours into one call; the frames freed since
+ * then wait for the next pass. The pool lock is held */
+void
+scavengeRegion(int i)
+{
+  char* unreleased = regions[i].unreleased;
+  int j, end;
+  
+  if (regions[i].backing != BACKING_MMAP || regions[i].warm)
+    {
+      return;
+    }
+  
+  for (j = 0; j < MAXPAGES; j = end)
+    {
+      for (end = j; end < MAXPAGES && unreleased[end] == RELEASE_AGED; end++)
+	{
+	  unreleased[end] = FALSE;
+	}
+      
+      if (end > j)
+	{
+	  madvise(regions[i].base + (long) j * PAGESIZE,
+		  (long) (end - j) * PAGESIZE, KPAGE_MADVISE);
+	  kma_page_stats.num_scavenged += end - j;
+	}
+      else
+	{
+	  if (unreleased[j] == RELEASE_FRESH)
+	    {
+	      unreleased[j] = RELEASE_AGED;
+	    }
+	  end++;
+	}
+    }
+}
+
+/* add a region before the callers run out of free pages, the pool lock
+ * is held */
+void
+growPool()
+{
+  int i, num_free = 0;
+  
+  for (i = 0; i < MAXREGIONS; i++)
+    {
+      if (regions[i].base != NULL)
+	{
+	  num_free += MAXPAGES - regions[i].num_in_use;
+	}
+    }
+  
+  if (num_free < KPAGE_SCAVENGE_LOW
+      && kma_page_stats.num_regions < MAXREGIONS)
+    {
+      initRegion();
+    }
+}
+
+#endif // KPAGE_SCAVENGE
+
+void
+idleRegion(int i)
+{
+  assert(regions[i].num_in_use == 0);
+  
+  regions[i].idle = TRUE;
+  regions[i].idle_op = num_ops;
+  regions[i].idle_usec = (KPAGE_RETAIN_USEC > 0) ? nowUsec() : 0;
+  num_idle++;
+}
+
+/* the pool is empty, every region becomes a release candidate */
+void
+idlePool()
+{
+  int i;
+  
+  drainCache(threadCache(), threadCache()->count);
+  
+  for (i = 0; i < MAXREGIONS; i++)
+    {
+      if (regions[i].base != NULL && !regions[i].idle)
+	{
+	  idleRegion(i);
+	}
+    }
+}
+
+/* release the idle regions whose retention window has passed, keeping
+ * at least KPAGE_RETAIN_PAGES free pages in the pool */
+void
+reapRegions()
+{
+  int i, num_free = 0;
+  long now = 0;
+  
+  if (num_idle == 0)
+    {
+      return;
+    }
+  
+  if (KPAGE_RETAIN_USEC > 0)
+    {
+      now = nowUsec();
+    }
+  
+  for (i = 0; i < MAXREGIONS; i++)
+    {
+      if (regions[i].base != NULL)
+	{
+	  num_free += MAXPAGES - regions[i].num_in_use;
+	}
+    }
+  
+  for (i = MAXREGIONS - 1; i >= 0 && num_idle > 0; i--)
+    {
+      if (!regions[i].idle || regions[i].warm)
+	{
+	  continue;
+	}
+      
+      if (!((KPAGE_RETAIN_OPS == 0 && KPAGE_RETAIN_USEC == 0)
+	    || (KPAGE_RETAIN_OPS > 0
+		&& num_ops - regions[i].idle_op >= KPAGE_RETAIN_OPS)
+	    || (KPAGE_RETAIN_USEC > 0
+		&& now - regions[i].idle_usec >= KPAGE_RETAIN_USEC)))
+	{
+	  continue;
+	}
+      
+      if (num_free - MAXPAGES < KPAGE_RETAIN_PAGES)
+	{
+	  continue;
+	}
+      
+      num_free -= MAXPAGES;
+      freeRegion(i);
+    }
+}
+
+long
+nowUsec()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int
+initRegion()
+{
+  int i, j;
+  void* base = NULL;
+  
+  for (i = 0; i < MAXREGIONS; i++)
+    {
+      if (regions[i].base == NULL)
+	{
+	  break;
+	}
+    }
+  
+  if (i == MAXREGIONS)
+    {
+      error("error: all pages already allocated", "");
+    }
+  
+  if (kma_page_stats.num_regions == 0 && kma_page_stats.num_teardowns > 0)
+    {
+      kma_page_stats.num_rebuilds++;
+    }
+  
+  base = mapRegion(&regions[i].backing);
+  kma_page_stats.backing = regions[i].backing;
+  
+  regions[i].frames = calloc(MAXPAGES, sizeof(kma_page_t));
+  regions[i].free_order = malloc(MAXPAGES * sizeof(signed char));
+  regions[i].block_type = calloc(NUMBLOCKS, sizeof(char));
+  regions[i].next_unused = 0;
+  regions[i].num_in_use = 0;
+  regions[i].idle = FALSE;
+  regions[i].warm = FALSE;
+  
+#if KPAGE_POLICY == KPAGE_LOWEST
+  regions[i].free_map = calloc(1, LISTMETA);
+  if (regions[i].free_map == NULL)
+    {
+      error("unable to allocate the free maps", "");
+    }
+  for (j = 0; j < PAGE_LIFETIMES * (KPAGE_MAXORDER + 1); j++)
+    {
+      regions[i].map_hint[j / (KPAGE_MAXORDER + 1)][j % (KPAGE_MAXORDER + 1)]
+	= MAPWORDS;
+    }
+#else
+  regions[i].free_next = malloc(MAXPAGES * sizeof(int));
+  regions[i].free_prev = malloc(MAXPAGES * sizeof(int));
+  if (regions[i].free_next == NULL || regions[i].free_prev == NULL)
+    {
+      error("unable to allocate the free lists", "");
+    }
+  memset(regions[i].free_head, -1, sizeof(regions[i].free_head));
+#endif
+  
+  if (regions[i].frames == NULL || regions[i].free_order == NULL
+      || regions[i].block_type == NULL)
+    {
+      error("unable to allocate the region metadata", "");
+    }
+  kma_page_stats.num_meta_bytes += REGIONMETA;
+  
+  // the whole region starts out as free runs of the top order
+  memset(regions[i].free_order, -1, MAXPAGES * sizeof(signed char));
+  memset(regions[i].num_free_runs, 0, sizeof(regions[i].num_free_runs));
+  for (j = MAXPAGES - (1 << KPAGE_MAXORDER); j >= 0; j -= 1 << KPAGE_MAXORDER)
+    {
+      linkRun(i, j, KPAGE_MAXORDER);
+    }
+  
+#ifdef KPAGE_MMAP
+  regions[i].unreleased = calloc(MAXPAGES, sizeof(char));
+  if (regions[i].unreleased == NULL)
+    {
+      error("unable to allocate the release map", "");
+    }
+#endif
+  
+#ifdef KPAGE_EAGER
+  // touch every page up front (faults in the whole region, kept for
+  // comparing startup cost)
+  for (j = 0; j < MAXPAGES; j++)
+    {
+      *((void**)(base + j * PAGESIZE)) = NULL;
+    }
+  regions[i].next_unused = MAXPAGES;
+#endif
+  
+  // publish last, page_lookup() looks at the regions without the lock
+  __atomic_store_n(&regions[i].base, base, __ATOMIC_RELEASE);
+  
+#ifdef KPAGE_SCAVENGE
+  if (!scavenger_started)
+    {
+      startScavenger();
+    }
+#endif
+  
+  kma_page_stats.num_regions++;
+  kma_page_stats.num_region_allocs++;
+  if (kma_page_stats.num_regions > kma_page_stats.max_regions)
+    {
+      kma_page_stats.max_regions = kma_page_stats.num_regions;
+    }
+  
+  return i;
+}
+
+void
+freeRegion(int i)
+{
+  assert(regions[i].base != NULL);
+  assert(regions[i].num_in_use == 0);
+  
+  unmapRegion(regions[i].base);
+  free(regions[i].frames);
+#if KPAGE_POLICY == KPAGE_LOWEST
+  free(regions[i].free_map);
+  regions[i].free_map = NULL;
+#else
+  free(regions[i].free_next);
+  free(regions[i].free_prev);
+  regions[i].free_next = NULL;
+  regions[i].free_prev = NULL;
+#endif
+  free(regions[i].free_order);
+  free(regions[i].block_type);
+  regions[i].base = NULL;
+  regions[i].frames = NULL;
+  regions[i].free_order = NULL;
+  regions[i].block_type = NULL;
+  memset(regions[i].num_free_runs, 0, sizeof(regions[i].num_free_runs));
+  kma_page_stats.num_meta_bytes -= REGIONMETA;
+#ifdef KPAGE_MMAP
+  free(regions[i].unreleased);
+  regions[i].unreleased = NULL;
+#endif
+  
+  if (regions[i].idle)
+    {
+      regions[i].idle = FALSE;
+      num_idle--;
+    }
+  
+  kma_page_stats.num_regions--;
+  kma_page_stats.num_region_frees++;
+  if (kma_page_stats.num_regions == 0)
+    {
+      kma_page_stats.num_teardowns++;
+    }
+}
+
+int
+findRegion(void* ptr)
+{
+#ifdef KPAGE_THREADS
+  static __thread int last = 0;
+#else
+  static int last = 0;
+#endif
+  int i;
+  
+  // lookups tend to hit the same region over and over
+  if (regions[last].base != NULL && ptr >= regions[last].base
+      && ptr < regions[last].base + REGIONSIZE)
+    {
+      return last;
+    }
+  
+  for (i = 0; i < MAXREGIONS; i++)
+    {
+      if (regions[i].base != NULL && ptr >= regions[i].base
+	  && ptr < regions[i].base + REGIONSIZE)
+	{
+	  last = i;
+	  return i;
+	}
+    }
+  
+  return -1;
+}
+
+kma_page_t*
+page_lookup(void* ptr)
+{
+  kma_page_t* res;
+  int i = findRegion(ptr);
+  int frame, order;
+  
+  if (i < 0)
+    {
+      return NULL;
+    }
+  
+  frame = (ptr - regions[i].base) >> PAGESHIFT;
+  res = &regions[i].frames[frame];
+  
+  // inside a run the descriptor sits at its first frame, which is
+  // aligned to the order of the run
+  for (order = 1; res->ptr == NULL && order <= KPAGE_MAXORDER; order++)
+    {
+      res = &regions[i].frames[frame & ~((1 << order) - 1)];
+    }
+  
+  if (res->ptr == NULL || ptr >= res->ptr + res->size)
+    {
+      return NULL;
+    }
+  
+  return res;
+}
+
+#ifndef KPAGE_MMAP
+
+void*
+mapRegion(int* backing)
+{
+  void* base = NULL;
+  
+  int result = posix_memalign(&base, PAGESIZE, REGIONSIZE);
+  if(result)
+    error("Error using posix_memalign to allocate memory", "");
+  
+  *backing = BACKING_HEAP;
+  return base;
+}
+
+void
+unmapRegion(void* base)
+{
+  free(base);
+}
+
+#else // KPAGE_MMAP
+
+/* reserve the address space only, the kernel commits each page on its
+ * first touch */
+void*
+reserveRegion(long align)
+{
+  void* res;
+  void* base;
+  long head;
+  
+  // over-reserve so the region can be aligned
+  res = mmap(NULL, REGIONSIZE + align, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (res == MAP_FAILED)
+    {
+      error("Error using mmap to reserve memory", "");
+    }
+  
+  base = (void*)(((long) res + align - 1) & ~(align - 1));
+  head = base - res;
+  if (head > 0)
+    {
+      munmap(res, head);
+    }
+  munmap(base + REGIONSIZE, align - head);
+  
+  return base;
+}
+
+void*
+mapRegion(int* backing)
+{
+#ifdef KPAGE_HUGE
+  void* base;
+  
+  // explicit huge pages only work if hugetlbfs has pages reserved
+  base = mmap(NULL, REGIONSIZE, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (base != MAP_FAILED)
+    {
+      *backing = BACKING_HUGETLB;
+      return base;
+    }
+  
+  // otherwise ask for transparent huge pages on a huge page aligned range
+  base = reserveRegion(KPAGE_HUGESIZE);
+  *backing = (madvise(base, REGIONSIZE, MADV_HUGEPAGE) == 0)
+    ? BACKING_THP : BACKING_MMAP;
+  return base;
+#else
+  *backing = BACKING_MMAP;
+  return reserveRegion(PAGESIZE);
+#endif
+}
+
+void
+unmapRegion(void* base)
+{
+  munmap(base, REGIONSIZE);
+}
+
+/* queue freed frames for madvise, the batch goes out once it is full */
+void
+releasePages(int region, int frame, int count)
+{
+  if (regions[region].backing != BACKING_MMAP || regions[region].warm)
+    {
+      // giving back part of a huge page would split it, and a warm
+      // region would only fault the page in again
+      return;
+    }
+  
+#if defined(KPAGE_SCAVENGE)
+  // left to the scavenger, in case the frames are taken again soon
+  memset(regions[region].unreleased + frame, RELEASE_FRESH, count);
+#elif KPAGE_RELEASE_BATCH > 1
+  int j;
+  
+  for (j = frame; j < frame + count; j++)
+    {
+      regions[region].unreleased[j] = TRUE;
+      pending_release[num_pending++] = regions[region].base + j * PAGESIZE;
+      
+      if (num_pending == KPAGE_RELEASE_BATCH)
+	{
+	  flushReleases();
+	}
+    }
+#else
+  madvise(regions[region].base + frame * PAGESIZE, (long) count * PAGESIZE,
+	  KPAGE_MADVISE);
+  kma_page_stats.num_released += count;
+#endif
+}
+
+#if KPAGE_RELEASE_BATCH > 1
+
+int
+comparePages(const void* lhs, const void* rhs)
+{
+  void* l = *((void**)lhs);
+  void* r = *((void**)rhs);
+  
+  return (l < r) ? -1 : (l > r);
+}
+
+/* madvise the pending frames that are still free, merging neighbours
+ * into one call */
+void
+flushReleases()
+{
+  int i, j, n = 0;
+  
+  for (i = 0; i < num_pending; i++)
+    {
+      void* ptr = pending_release[i];
+      int region = findRegion(ptr);
+      int frame;
+      
+      if (region < 0)
+	{
+	  continue;
+	}
+      
+      frame = (ptr - regions[region].base) / PAGESIZE;
+      if (regions[region].unreleased[frame])
+	{
+	  regions[region].unreleased[frame] = FALSE;
+	  pending_release[n++] = ptr;
+	}
+    }
+  
+  qsort(pending_release, n, sizeof(void*), comparePages);
+  
+  for (i = 0; i < n; i = j)
+    {
+      for (j = i + 1; j < n; j++)
+	{
+	  if (pending_release[j] != pending_release[j - 1] + PAGESIZE)
+	    {
+	      break;
+	    }
+	}
+      
+      madvise(pending_release[i], (j - i) * PAGESIZE, KPAGE_MADVISE);
+      kma_page_stats.num_released += j - i;
+    }
+  
+  num_pending = 0;
+}
+
+#endif // KPAGE_RELEASE_BATCH > 1
+
+#endif // KPAGE_MMAP
+
+void
+page_warm(int num_pages)
+{
+  int i;
+  
+  LOCK();
+#if defined(KPAGE_MMAP) && KPAGE_RELEASE_BATCH > 1
+  // pending releases would throw warmed frames out again
+  flushReleases();
+#endif
+  
+  for (i = 0; i < MAXREGIONS && num_pages > 0; i++)
+    {
+      if (regions[i].base == NULL)
+	{
+	  // the lower slots are taken, so this one is next
+	  i = initRegion();
+	}
+      
+      if (!regions[i].warm)
+	{
+	  warmRegion(i);
+	}
+      num_pages -= MAXPAGES;
+    }
+  UNLOCK();
+}
+
+/* fault in the frames of a region that were never handed out (the
+ * others hold data or are resident anyway), the pool lock is held */
+void
+warmRegion(int i)
+{
+  long sys_page = sysconf(_SC_PAGESIZE);
+  char* start = regions[i].base + (long) regions[i].next_unused * PAGESIZE;
+  char* end = regions[i].base + REGIONSIZE;
+  
+#if defined(KPAGE_MMAP) && defined(MADV_POPULATE_WRITE)
+  // MAP_POPULATE after the fact, in one call (Linux 5.14 and later)
+  if (start < end && madvise(start, end - start, MADV_POPULATE_WRITE) == 0)
+    {
+      start = end;
+    }
+#endif
+  
+  // otherwise touch every system page
+  for (; start < end; start += sys_page)
+    {
+      *((volatile char*) start) = 0;
+    }
+  
+  kma_page_stats.num_warm += MAXPAGES - regions[i].next_unused;
+  regions[i].next_unused = MAXPAGES;
+  regions[i].warm = TRUE;
+}
+
+char*
+page_backing_name(int backing)
+{
+  assert(backing >= 0 && backing <= BACKING_HUGETLB);
+  
+  return backing_names[backing];
+}
+
+/* bytes of the pool backed by physical memory right now */
+long
+page_resident()
+{
+  long sys_page = sysconf(_SC_PAGESIZE);
+  long vec_size = REGIONSIZE / sys_page;
+  unsigned char* vec = malloc(vec_size);
+  long res = 0;
+  int i, j;
+  
+  if (vec == NULL)
+    {
+      return -1;
+    }
+  
+  for (i = 0; i < MAXREGIONS; i++)
+    {
+      if (regions[i].base == NULL
+	  || mincore(regions[i].base, REGIONSIZE, vec) != 0)
+	{
+	  continue;
+	}
+      
+      for (j = 0; j < vec_size; j++)
+	{
+	  res += vec[j] & 1;
+	}
+    }
+  
+  free(vec);
+  
+  return res * sys_page;
 }
@@ -62,10 +62,206 @@
 #define EXTERN extern
 #endif
 
+/* page size in bytes, pick another with -DPAGESIZE=4096 (4K to 64K) */
+#ifndef PAGESIZE
 #define PAGESIZE 8192
+#endif
 
+#if PAGESIZE == 4096
+#define PAGESHIFT 12
+#elif PAGESIZE == 8192
+#define PAGESHIFT 13
+#elif PAGESIZE == 16384
+#define PAGESHIFT 14
+#elif PAGESIZE == 32768
+#define PAGESHIFT 15
+#elif PAGESIZE == 65536
+#define PAGESHIFT 16
+#else
+#error "PAGESIZE must be a power of two between 4096 and 65536"
+#endif
+
+/* number of pages in one pool region */
 #define MAXPAGES 4096
 
+/* upper bound on the number of regions the pool may grow to */
+#ifndef MAXREGIONS
+#define MAXREGIONS 16
+#endif
+
+/* define KPAGE_EAGER to touch every page of a new region up front instead
+ * of leaving pages untouched until they are first handed out */
+
+/* pages the test harness warms up with page_warm() before it replays a
+ * trace (0 starts cold), so page faults stay out of the timed replay */
+#ifndef KPAGE_WARM
+#define KPAGE_WARM 0
+#endif
+
+/* release a region as soon as its last page is freed (0 keeps regions
+ * around until the whole pool is empty) */
+#ifndef KPAGE_SHRINK
+#define KPAGE_SHRINK 1
+#endif
+
+/* retention of empty regions: an emptied region (or the whole pool once
+ * no page is in use) is only released after it stayed idle for
+ * KPAGE_RETAIN_OPS page operations or KPAGE_RETAIN_USEC microseconds,
+ * whichever is enabled and passes first; both 0 releases immediately.
+ * KPAGE_RETAIN_PAGES free pages are never released. */
+#ifndef KPAGE_RETAIN_OPS
+#define KPAGE_RETAIN_OPS 1024
+#endif
+
+#ifndef KPAGE_RETAIN_USEC
+#define KPAGE_RETAIN_USEC 0
+#endif
+
+#ifndef KPAGE_RETAIN_PAGES
+#define KPAGE_RETAIN_PAGES 0
+#endif
+
+/* define KPAGE_MMAP to reserve regions with mmap instead of posix_memalign;
+ * pages are committed on first touch and a freed page is handed back to
+ * the system with madvise(KPAGE_MADVISE) once KPAGE_RELEASE_BATCH freed
+ * pages have queued up (1 releases each page as it is freed) */
+#ifndef KPAGE_MADVISE
+#define KPAGE_MADVISE MADV_DONTNEED
+#endif
+
+#ifndef KPAGE_RELEASE_BATCH
+#define KPAGE_RELEASE_BATCH 1
+#endif
+
+/* define KPAGE_HUGE (implies KPAGE_MMAP) to back regions with huge pages:
+ * MAP_HUGETLB when hugetlbfs has pages reserved, otherwise a huge page
+ * aligned range with madvise(MADV_HUGEPAGE). Freed pages of a huge page
+ * backed region are not released since that would split the huge pages. */
+#ifdef KPAGE_HUGE
+#ifndef KPAGE_MMAP
+#define KPAGE_MMAP
+#endif
+#endif
+
+#ifndef KPAGE_HUGESIZE
+#define KPAGE_HUGESIZE (2 * 1024 * 1024)
+#endif
+
+/* define KPAGE_SCAVENGE (needs KPAGE_THREADS, implies KPAGE_MMAP) to run a
+ * helper thread every KPAGE_SCAVENGE_USEC microseconds. Freed pages are no
+ * longer released as they are freed; the thread releases the ones that
+ * stayed free for a whole period. It also keeps KPAGE_ZERO_PAGES zeroed
+ * pages ready for get_zeroed_page() and adds a region ahead of time once
+ * fewer than KPAGE_SCAVENGE_LOW pages are free in the pool. */
+#ifdef KPAGE_SCAVENGE
+#ifndef KPAGE_THREADS
+#error "KPAGE_SCAVENGE needs KPAGE_THREADS"
+#endif
+#ifndef KPAGE_MMAP
+#define KPAGE_MMAP
+#endif
+#endif
+
+#ifndef KPAGE_SCAVENGE_USEC
+#define KPAGE_SCAVENGE_USEC 10000
+#endif
+
+#ifndef KPAGE_ZERO_PAGES
+#define KPAGE_ZERO_PAGES 16
+#endif
+
+#ifndef KPAGE_SCAVENGE_LOW
+#define KPAGE_SCAVENGE_LOW (MAXPAGES / 8)
+#endif
+
+/* regions are run by a buddy allocator handing out runs of 2^order pages,
+ * order 0 to KPAGE_MAXORDER (at most 12, a whole region) */
+#ifndef KPAGE_MAXORDER
+#define KPAGE_MAXORDER 10
+#endif
+
+/* anti-fragmentation grouping: each pageblock of 2^KPAGE_BLOCK_ORDER pages
+ * serves one lifetime class and runs are taken from pageblocks of their
+ * own class first, so short lived runs do not break up the pageblocks
+ * long lived pages sit in. KPAGE_GROUPING 0 puts every run on one list. */
+#ifndef KPAGE_BLOCK_ORDER
+#define KPAGE_BLOCK_ORDER 6
+#endif
+
+#ifndef KPAGE_GROUPING
+#define KPAGE_GROUPING 1
+#endif
+
+/* which free run goes out first: KPAGE_LIFO takes the one freed last
+ * from a linked list (cheap, but after some churn pages taken in a row
+ * are scattered over the pool), KPAGE_LOWEST keeps a bitmap per list and
+ * takes the lowest run with find-first-set, so they stay close */
+#define KPAGE_LIFO 0
+#define KPAGE_LOWEST 1
+
+#ifndef KPAGE_POLICY
+#define KPAGE_POLICY KPAGE_LIFO
+#endif
+
+#if KPAGE_MAXORDER > 12 || KPAGE_BLOCK_ORDER > KPAGE_MAXORDER
+#error "KPAGE_BLOCK_ORDER <= KPAGE_MAXORDER <= 12 (a region is 4096 pages)"
+#endif
+
+/* up to KPAGE_CACHE_SIZE freed single pages are cached in front of the
+ * buddy allocator, refilled and drained KPAGE_CACHE_BATCH at a time, so
+ * page churn does not split and merge runs all the time.
+ * define KPAGE_THREADS (and link with -pthread) to share the pool between
+ * threads: every thread has a cache of its own, and caches pass single
+ * pages to each other through a lock-free stack of up to
+ * KPAGE_STACK_SIZE pages; only the buddy allocator behind it runs under
+ * a pool lock. Regions are never released in this mode and freed pages
+ * are released one at a time. */
+#ifndef KPAGE_CACHE_SIZE
+#define KPAGE_CACHE_SIZE 64
+#endif
+
+#ifndef KPAGE_CACHE_BATCH
+#define KPAGE_CACHE_BATCH (KPAGE_CACHE_SIZE / 2)
+#endif
+
+#ifndef KPAGE_STACK_SIZE
+#define KPAGE_STACK_SIZE (4 * KPAGE_CACHE_SIZE)
+#endif
+
+#ifdef KPAGE_THREADS
+#undef KPAGE_RELEASE_BATCH
+#define KPAGE_RELEASE_BATCH 1
+#endif
+
+/* where the memory of a region came from */
+enum PAGE_BACKING
+  {
+    BACKING_HEAP,
+    BACKING_MMAP,
+    BACKING_THP,
+    BACKING_HUGETLB
+  };
+
+/* lifetime class of the owner of a run, see get_pages() */
+enum PAGE_LIFETIME
+  {
+    PAGE_LONG,  // kept while any object on it lives, e.g. a slab page
+    PAGE_SHORT, // given back with its single object, e.g. a large request
+    PAGE_LIFETIMES
+  };
+
+/* what an owner uses a page for, see page_tag(); pages start out
+ * TAG_NONE and go back to it when freed */
+enum PAGE_TAG
+  {
+    TAG_NONE,  // not tagged by its owner
+    TAG_DATA,  // holds the objects handed out
+    TAG_META,  // bookkeeping only, e.g. a list head page
+    TAG_LARGE, // a run for a single request too large to share a page
+    TAG_SPARE, // taken ahead of time and not used yet
+    PAGE_TAGS
+  };
+
 /***********************************************************************
  *  Title: Base Address Macro
  * ---------------------------------------------------------------------
@@ -76,21 +272,69 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+/* page descriptor; it lives in the pool's descriptor table and id is
+ * the page frame number. private is a word the owner of the page may
+ * use as it likes (NULL when the page is handed out), tag is set with
+ * page_tag(). */
 typedef struct
 {
   int id;
   void* ptr;
   int size;
+  int tag;
+  void* private;
 } kma_page_t;
 
+typedef struct
+{
+  void* base;
+  int num_pages;
+  int num_in_use;
+  int num_touched;
+  int backing;
+} kma_region_stat_t;
+
 typedef struct
 {
   int num_requested;
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_regions;
+  int max_regions;
+  int num_region_allocs;
+  int num_region_frees;
+  int num_region_revivals;
+  int num_teardowns;
+  int num_rebuilds;
+  int num_released;
+  int num_meta_bytes;   // descriptor tables and free lists of the pool
+  int backing;
+  int num_fallbacks;    // runs taken from pageblocks of another class
+  int num_warm;         // pages faulted in up front by page_warm()
+  int num_scavenged;    // free pages released by the scavenger
+  int num_prezeroed;    // pages zeroed by the scavenger
+  int num_zero_hits;    // get_zeroed_page() served from the zeroed pages
+  int num_zero_misses;  // get_zeroed_page() zeroing on the spot
+  kma_region_stat_t regions[MAXREGIONS];
 } kma_page_stat_t;
 
+/* free runs of the buddy allocator, see page_free_runs() */
+typedef struct
+{
+  int largest_free_run; // pages in the largest free run of the pool
+  int free_runs[KPAGE_MAXORDER + 1]; // free runs of each order
+} kma_free_run_stat_t;
+
+/* pages of one tag; the peak is not tracked for TAG_NONE, its pages are
+ * whatever is in use and not tagged */
+typedef struct
+{
+  int num_in_use;
+  int max_in_use;
+  int num_tagged;       // pages given the tag so far
+} kma_tag_stat_t;
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -113,15 +357,173 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Allocates a run of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates 2^order contiguous pages described by one
+ *             page structure (size is the size of the run). Runs of
+ *             the same lifetime class are grouped together, single
+ *             pages from get_page() are PAGE_LONG
+ *    Input: the order (0 to KPAGE_MAXORDER) and a PAGE_LIFETIME
+ *    Output: the page structure of the run
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int, int);
+
+/***********************************************************************
+ *  Title: Releases a run of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run from get_pages() (or a single page)
+ *    Input: the page structure of the run
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
+/***********************************************************************
+ *  Title: Allocates a zeroed memory page
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a memory page filled with zeros, one zeroed
+ *             ahead of time by the scavenger when there is one
+ *    Input: none
+ *    Output: the allocated memory page, released with free_page()
+ ***********************************************************************/
+EXTERN kma_page_t* get_zeroed_page();
+
+/***********************************************************************
+ *  Title: Allocates several memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n single pages as get_page() would, paying the
+ *             bookkeeping (and the pool lock) once for the whole batch
+ *    Input: the number of pages and an array to hold them
+ *    Output: the allocated memory pages in pages[0..n)
+ ***********************************************************************/
+EXTERN void get_pages_batch(int, kma_page_t**);
+
+/***********************************************************************
+ *  Title: Releases several memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases n pages from get_page() or get_pages_batch(),
+ *             paying the bookkeeping (and the pool lock) once
+ *    Input: the number of pages and the array holding them
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages_batch(int, kma_page_t**);
+
+/***********************************************************************
+ *  Title: Run order
+ * ---------------------------------------------------------------------
+ *    Purpose: Smallest order of a run that holds the given size
+ *    Input: size in bytes
+ *    Output: the order, may be above KPAGE_MAXORDER
+ ***********************************************************************/
+EXTERN int page_order(int);
+
+/***********************************************************************
+ *  Title: Page lookup
+ * ---------------------------------------------------------------------
+ *    Purpose: Find the page an address belongs to through the frame
+ *             table, so allocators need not keep a back pointer in
+ *             the page itself
+ *    Input: any address inside an allocated page
+ *    Output: the page structure, or NULL if the address is not in an
+ *            allocated page of the pool
+ ***********************************************************************/
+EXTERN kma_page_t* page_lookup(void*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
- *    Purpose: Get the memory page statistics
+ *    Purpose: Get the memory page statistics; regions[] holds the
+ *             usage of each live pool region (base == NULL for an
+ *             unused slot)
  *    Input: none 
  *    Output: the memory page statistics in a static buffer
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Free run statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Count the free runs of every order over the regions of
+ *             the pool; a scan, so for reports and samples rather than
+ *             every page operation
+ *    Input: none
+ *    Output: the free run statistics in a static buffer
+ ***********************************************************************/
+EXTERN kma_free_run_stat_t* page_free_runs();
+
+/***********************************************************************
+ *  Title: Reset page statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Start the statistics over between two users of an empty
+ *             pool, e.g. allocators replayed one after the other: the
+ *             counters and peaks go back to what is in use now, and
+ *             idle regions are released right away instead of being
+ *             revived by the next user
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_stats_reset();
+
+/***********************************************************************
+ *  Title: Page tag
+ * ---------------------------------------------------------------------
+ *    Purpose: Account a page (or a run, or a zeroed page) to what its
+ *             owner uses it for, until it is freed or tagged again
+ *    Input: the page structure and a PAGE_TAG
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_tag(kma_page_t*, int);
+
+/***********************************************************************
+ *  Title: Page statistics per tag
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the pages in use, their peak and the pages tagged so
+ *             far for every tag
+ *    Input: none
+ *    Output: PAGE_TAGS entries indexed by tag in a static buffer
+ ***********************************************************************/
+EXTERN kma_tag_stat_t* page_tag_stats();
+
+/***********************************************************************
+ *  Title: Page tag name
+ * ---------------------------------------------------------------------
+ *    Purpose: Name a tag
+ *    Input: the tag
+ *    Output: a static string such as "data" or "meta"
+ ***********************************************************************/
+EXTERN char* page_tag_name(int);
+
+/***********************************************************************
+ *  Title: Warm start
+ * ---------------------------------------------------------------------
+ *    Purpose: Grows the pool to hold at least the given number of pages
+ *             and faults all of them in up front. Warm regions are
+ *             never released and keep freed pages resident, so page
+ *             faults stay out of whatever runs afterwards
+ *    Input: the number of pages
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_warm(int);
+
+/***********************************************************************
+ *  Title: Resident pool memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Measure how much of the pool is backed by physical
+ *             memory (walks every region with mincore, not cheap)
+ *    Input: none
+ *    Output: the resident bytes, or -1 if it cannot be measured
+ ***********************************************************************/
+EXTERN long page_resident();
+
+/***********************************************************************
+ *  Title: Page backing name
+ * ---------------------------------------------------------------------
+ *    Purpose: Name a region backing (the backing field of the stats)
+ *    Input: the backing
+ *    Output: a static string such as "thp" or "hugetlb"
+ ***********************************************************************/
+EXTERN char* page_backing_name(int);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
@@ -0,0 +1,596 @@
+/***************************************************************************
+ *  Title: Kernel Page Allocator Benchmark
+ * -------------------------------------------------------------------------
+ *    Purpose: Micro benchmarks for the kernel page allocator
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef KPAGE_THREADS
+#include <pthread.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+typedef struct
+{
+  char* name;
+  void (*run)(int);
+  int count;
+} bench_t;
+
+/************Function Prototypes******************************************/
+void bench_startup(int);
+void bench_churn(int);
+void bench_scale(int);
+void bench_frag(int);
+void bench_locality(int);
+void bench_burst(int);
+void bench_zero(int);
+double burst(int, int);
+int compareLongs(const void*, const void*);
+double churn(int, unsigned int);
+double now();
+long rss_kb();
+void usage();
+void error(char*, char*);
+
+/************Global Variables*********************************************/
+
+static bench_t benches[] =
+  {
+    { "startup",  bench_startup,  100     },
+    { "churn",    bench_churn,    1000000 },
+    { "scale",    bench_scale,    1000000 },
+    { "frag",     bench_frag,     1000000 },
+    { "locality", bench_locality, 1000000 },
+    { "burst",    bench_burst,    10000   },
+    { "zero",     bench_zero,     1000    },
+    { NULL,       NULL,           0       }
+  };
+
+char* name = NULL;
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  bench_t* b;
+  int count;
+
+  name = argv[0];
+
+  if (argc < 2)
+    {
+      usage();
+    }
+
+  for (b = benches; b->name != NULL; b++)
+    {
+      if (strcmp(b->name, argv[1]) == 0)
+	{
+	  count = (argc > 2) ? atoi(argv[2]) : b->count;
+	  b->run(count);
+	  return 0;
+	}
+    }
+
+  usage();
+  return 0;
+}
+
+/* time to the first page and resident memory after touching count pages */
+void
+bench_startup(int count)
+{
+  kma_page_t** pages = malloc(count * sizeof(kma_page_t*));
+  long rss_before, rss_after;
+  double start, first, end;
+  int i;
+
+  assert(pages != NULL);
+
+  rss_before = rss_kb();
+  start = now();
+  pages[0] = get_page();
+  first = now();
+
+  for (i = 0; i < count; i++)
+    {
+      if (i > 0)
+	{
+	  pages[i] = get_page();
+	}
+      memset(pages[i]->ptr, 0, pages[i]->size);
+    }
+  end = now();
+  rss_after = rss_kb();
+
+  printf("%s startup: first page %.1f us, %d pages %.1f us, rss +%ld KB\n",
+	 name, (first - start) * 1e6, count, (end - start) * 1e6,
+	 rss_after - rss_before);
+
+  for (i = 0; i < count; i++)
+    {
+      free_page(pages[i]);
+    }
+  free(pages);
+}
+
+/* get_page/free_page throughput: count pairs against a working set of
+ * CHURN_PAGES pages, replacing a pseudo random one each time */
+#define CHURN_PAGES 256
+
+void
+bench_churn(int count)
+{
+  double elapsed = churn(count, 42);
+
+  printf("%s churn: %d get/free pairs in %.3f s, %.1f ns/pair, %.2f Mpairs/s\n",
+	 name, count, elapsed, elapsed * 1e9 / count, count / elapsed / 1e6);
+}
+
+/* seconds taken by count churn pairs */
+double
+churn(int count, unsigned int seed)
+{
+  kma_page_t* pages[CHURN_PAGES];
+  double start, end;
+  int i;
+
+  for (i = 0; i < CHURN_PAGES; i++)
+    {
+      pages[i] = get_page();
+    }
+
+  start = now();
+  for (i = 0; i < count; i++)
+    {
+      int victim = rand_r(&seed) % CHURN_PAGES;
+
+      free_page(pages[victim]);
+      pages[victim] = get_page();
+    }
+  end = now();
+
+  for (i = 0; i < CHURN_PAGES; i++)
+    {
+      free_page(pages[i]);
+    }
+
+  return end - start;
+}
+
+#ifdef KPAGE_THREADS
+
+typedef struct
+{
+  pthread_barrier_t* start;
+  int count;
+  unsigned int seed;
+} scale_arg_t;
+
+void*
+scaleThread(void* arg)
+{
+  scale_arg_t* a = arg;
+
+  pthread_barrier_wait(a->start);
+  churn(a->count, a->seed);
+
+  return NULL;
+}
+
+#endif
+
+/* churn throughput of 1, 2, 4, ... threads up to the number of cpus, each
+ * thread doing count pairs on its own working set */
+void
+bench_scale(int count)
+{
+#ifdef KPAGE_THREADS
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads, i;
+
+  for (threads = 1; ; threads = (threads * 2 > cpus) ? cpus : threads * 2)
+    {
+      pthread_t tids[threads];
+      scale_arg_t args[threads];
+      pthread_barrier_t start;
+      double begin, elapsed;
+
+      pthread_barrier_init(&start, NULL, threads + 1);
+      for (i = 0; i < threads; i++)
+	{
+	  args[i].start = &start;
+	  args[i].count = count;
+	  args[i].seed = 42 + i;
+	  if (pthread_create(&tids[i], NULL, scaleThread, &args[i]) != 0)
+	    {
+	      error("unable to start a thread", "");
+	    }
+	}
+
+      pthread_barrier_wait(&start);
+      begin = now();
+      for (i = 0; i < threads; i++)
+	{
+	  pthread_join(tids[i], NULL);
+	}
+      elapsed = now() - begin;
+      pthread_barrier_destroy(&start);
+
+      printf("%s scale: %2d threads, %.2f Mpairs/s total, %.2f Mpairs/s per thread\n",
+	     name, threads, (double) threads * count / elapsed / 1e6,
+	     count / elapsed / 1e6);
+
+      if (threads >= cpus)
+	{
+	  break;
+	}
+    }
+#else
+  error("the page layer was built without KPAGE_THREADS", "scale");
+#endif
+}
+
+/* contiguity under mixed lifetimes: count operations come and go on a
+ * slowly changing set of up to FRAG_LONG single pages and a busy set of
+ * up to FRAG_SHORT runs of 1 to 8 pages. Once the runs are gone, how much
+ * of the free memory is still in runs of at least a pageblock? */
+#define FRAG_LONG 2048
+#define FRAG_SHORT 256
+
+void
+bench_frag(int count)
+{
+  kma_page_t* longs[FRAG_LONG] = { NULL };
+  kma_page_t* shorts[FRAG_SHORT] = { NULL };
+  kma_page_stat_t* stat;
+  kma_free_run_stat_t* runs;
+  unsigned int seed = 42;
+  int i, order, num_free = 0, num_block = 0;
+
+  for (i = 0; i < count; i++)
+    {
+      int r = rand_r(&seed);
+
+      if (r % 8 == 0)
+	{
+	  int victim = (r / 8) % FRAG_LONG;
+
+	  if (longs[victim] != NULL)
+	    {
+	      free_page(longs[victim]);
+	      longs[victim] = NULL;
+	    }
+	  else
+	    {
+	      longs[victim] = get_page();
+	    }
+	}
+      else
+	{
+	  int victim = (r / 8) % FRAG_SHORT;
+
+	  if (shorts[victim] != NULL)
+	    {
+	      free_pages(shorts[victim]);
+	      shorts[victim] = NULL;
+	    }
+	  else
+	    {
+	      shorts[victim] = get_pages(rand_r(&seed) % 4, PAGE_SHORT);
+	    }
+	}
+    }
+
+  for (i = 0; i < FRAG_SHORT; i++)
+    {
+      if (shorts[i] != NULL)
+	{
+	  free_pages(shorts[i]);
+	}
+    }
+
+  stat = page_stats();
+  runs = page_free_runs();
+  for (order = 0; order <= KPAGE_MAXORDER; order++)
+    {
+      num_free += runs->free_runs[order] << order;
+      if (order >= KPAGE_BLOCK_ORDER)
+	{
+	  num_block += runs->free_runs[order] << order;
+	}
+    }
+
+  printf("%s frag: grouping %d, %d pages in use, %d free, %.1f%% of it in "
+	 "runs of %d+ pages, largest %d, %d fallbacks\n",
+	 name, KPAGE_GROUPING, stat->num_in_use, num_free,
+	 num_free ? 100.0 * num_block / num_free : 0.0,
+	 1 << KPAGE_BLOCK_ORDER, runs->largest_free_run, stat->num_fallbacks);
+
+  for (i = 0; i < FRAG_LONG; i++)
+    {
+      if (longs[i] != NULL)
+	{
+	  free_page(longs[i]);
+	}
+    }
+}
+
+/* spatial locality after churn: count toggles over a working set of
+ * LOCALITY_PAGES pages scatter the free ones, then LOCALITY_CHAIN pages
+ * are taken in a row, the way an allocator grows its page list, and
+ * chained through their first word. Reports how far apart they are and
+ * the time to walk the chain, which mostly is TLB and prefetch misses */
+#define LOCALITY_PAGES 2048
+#define LOCALITY_CHAIN 512
+#define LOCALITY_WALKS 1000
+
+void
+bench_locality(int count)
+{
+  kma_page_t* pages[LOCALITY_PAGES] = { NULL };
+  kma_page_t* chain[LOCALITY_CHAIN];
+  long windows[LOCALITY_CHAIN];
+  unsigned int seed = 42;
+  char* lo = NULL;
+  char* hi = NULL;
+  char* p;
+  double jumps = 0.0, start, end;
+  int i, num_windows = 1;
+
+  for (i = 0; i < count; i++)
+    {
+      int victim = rand_r(&seed) % LOCALITY_PAGES;
+
+      if (pages[victim] != NULL)
+	{
+	  free_page(pages[victim]);
+	  pages[victim] = NULL;
+	}
+      else
+	{
+	  pages[victim] = get_page();
+	}
+    }
+
+  for (i = 0; i < LOCALITY_CHAIN; i++)
+    {
+      chain[i] = get_page();
+      p = chain[i]->ptr;
+
+      if (lo == NULL || p < lo)
+	{
+	  lo = p;
+	}
+      if (hi == NULL || p > hi)
+	{
+	  hi = p;
+	}
+      if (i > 0)
+	{
+	  jumps += labs(p - (char*) chain[i - 1]->ptr) / PAGESIZE;
+	  *((void**) chain[i - 1]->ptr) = p;
+	}
+      windows[i] = (long) p / KPAGE_HUGESIZE;
+    }
+  *((void**) chain[LOCALITY_CHAIN - 1]->ptr) = NULL;
+
+  // huge page sized windows the chain touches
+  qsort(windows, LOCALITY_CHAIN, sizeof(long), compareLongs);
+  for (i = 1; i < LOCALITY_CHAIN; i++)
+    {
+      if (windows[i] != windows[i - 1])
+	{
+	  num_windows++;
+	}
+    }
+
+  start = now();
+  for (i = 0; i < LOCALITY_WALKS; i++)
+    {
+      for (p = chain[0]->ptr; p != NULL; p = *((char**) p))
+	;
+    }
+  end = now();
+
+  printf("%s locality: policy %s, %d pages in a row span %ld pages, "
+	 "mean jump %.1f pages, %d windows of %d KB, walk %.2f ns/page\n",
+	 name, (KPAGE_POLICY == KPAGE_LOWEST) ? "lowest" : "lifo",
+	 LOCALITY_CHAIN, (hi - lo) / PAGESIZE + 1,
+	 jumps / (LOCALITY_CHAIN - 1), num_windows, KPAGE_HUGESIZE / 1024,
+	 (end - start) * 1e9 / LOCALITY_WALKS / LOCALITY_CHAIN);
+
+  for (i = 0; i < LOCALITY_CHAIN; i++)
+    {
+      free_page(chain[i]);
+    }
+  for (i = 0; i < LOCALITY_PAGES; i++)
+    {
+      if (pages[i] != NULL)
+	{
+	  free_page(pages[i]);
+	}
+    }
+}
+
+/* allocation bursts: count times take BURST_PAGES pages and give them
+ * back, one call per page and then with batches of 1, 4, 16, ... pages.
+ * One page stays out so the pool does not go idle between bursts */
+#define BURST_PAGES 256
+
+void
+bench_burst(int count)
+{
+  kma_page_t* held = get_page();
+  double elapsed;
+  int batch;
+
+  elapsed = burst(count, 0);
+  printf("%s burst: %d pages, single calls, %.1f ns/page\n",
+	 name, BURST_PAGES, elapsed * 1e9 / count / BURST_PAGES);
+
+  for (batch = 1; batch <= BURST_PAGES; batch *= 4)
+    {
+      elapsed = burst(count, batch);
+      printf("%s burst: %d pages, batches of %3d, %.1f ns/page\n",
+	     name, BURST_PAGES, batch, elapsed * 1e9 / count / BURST_PAGES);
+    }
+
+  free_page(held);
+}
+
+/* seconds taken by count bursts, batch 0 for get_page/free_page */
+double
+burst(int count, int batch)
+{
+  kma_page_t* pages[BURST_PAGES];
+  double start, end;
+  int i, j;
+
+  start = now();
+  for (i = 0; i < count; i++)
+    {
+      for (j = 0; j < BURST_PAGES; j += (batch > 0) ? batch : 1)
+	{
+	  if (batch > 0)
+	    {
+	      get_pages_batch(batch, pages + j);
+	    }
+	  else
+	    {
+	      pages[j] = get_page();
+	    }
+	}
+      for (j = 0; j < BURST_PAGES; j += (batch > 0) ? batch : 1)
+	{
+	  if (batch > 0)
+	    {
+	      free_pages_batch(batch, pages + j);
+	    }
+	  else
+	    {
+	      free_page(pages[j]);
+	    }
+	}
+    }
+  end = now();
+
+  return end - start;
+}
+
+/* zeroed pages: count rounds of taking ZERO_PAGES pages with
+ * get_zeroed_page() and giving them back, with a pause in between that
+ * leaves a scavenger (KPAGE_SCAVENGE) time to zero the next ones. Only
+ * the get_zeroed_page() calls are timed */
+#define ZERO_PAGES 16
+#define ZERO_PAUSE_USEC 20000
+
+void
+bench_zero(int count)
+{
+  kma_page_t* pages[ZERO_PAGES];
+  struct timespec pause = { 0, ZERO_PAUSE_USEC * 1000 };
+  kma_page_stat_t* stat;
+  double start, elapsed = 0;
+  int i, j;
+
+  for (i = 0; i < count; i++)
+    {
+      start = now();
+      for (j = 0; j < ZERO_PAGES; j++)
+	{
+	  pages[j] = get_zeroed_page();
+	}
+      elapsed += now() - start;
+
+      for (j = 0; j < ZERO_PAGES; j++)
+	{
+	  assert(((char*) pages[j]->ptr)[PAGESIZE - 1] == 0);
+	  ((char*) pages[j]->ptr)[PAGESIZE - 1] = 1;
+	  free_page(pages[j]);
+	}
+      nanosleep(&pause, NULL);
+    }
+
+  stat = page_stats();
+  printf("%s zero: %.1f ns/page, %d hits/%d misses, %d prezeroed, %d scavenged\n",
+	 name, elapsed * 1e9 / count / ZERO_PAGES, stat->num_zero_hits,
+	 stat->num_zero_misses, stat->num_prezeroed, stat->num_scavenged);
+}
+
+int
+compareLongs(const void* lhs, const void* rhs)
+{
+  long l = *((long*)lhs);
+  long r = *((long*)rhs);
+
+  return (l < r) ? -1 : (l > r);
+}
+
+double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long
+rss_kb()
+{
+  long size = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+
+  if (f == NULL)
+    {
+      return 0;
+    }
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+    {
+      resident = 0;
+    }
+  fclose(f);
+
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void
+usage()
+{
+  bench_t* b;
+
+  printf("Usage: %s benchmark [count]\n", name);
+  printf("Benchmarks:");
+  for (b = benches; b->name != NULL; b++)
+    {
+      printf(" %s", b->name);
+    }
+  printf("\n");
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
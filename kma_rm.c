@@ -57,17 +57,22 @@ typedef struct _header {
   void *next;
 } header_t;
 
+// largest request that still fits a shared page next to its header and
+// the free header after it
+#define MAXSIZE (PAGESIZE - 2 * sizeof(header_t))
+
 /************Global Variables*********************************************/
 static kma_page_t* entry = NULL;
+static int g_blocks = 0; // handed out from shared pages, a header each
 
 /************Function Prototypes******************************************/
-void init_page(kma_page_t**);
-void print_free_list();
-void coalesce();
-void attempt_to_free_pages();
-void check_list();
-header_t* get_head();
-void move_head(header_t**);
+static void init_page(kma_page_t*);
+static void print_free_list();
+static void coalesce();
+static void attempt_to_free_pages();
+static void check_list();
+static header_t* get_head();
+static void move_head(header_t**);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -85,14 +90,23 @@ void move_head(header_t** dest)
 void*
 kma_malloc(kma_size_t size)
 {
-  if (size > PAGESIZE - sizeof(header_t)) return NULL;
+  if (size > MAXSIZE) {
+    // too big to share a page, give it a run of its own
+    int order = page_order(size);
+    if (order > KPAGE_MAXORDER) return NULL;
+    kma_page_t *run = get_pages(order, PAGE_SHORT);
+    page_tag(run, TAG_LARGE);
+    return run->ptr;
+  }
   if (entry == NULL) {
     kma_page_t *page = get_page();
-    init_page(&page);
+    page_tag(page, TAG_DATA);
+    init_page(page);
 
-    header_t* head = (header_t*)(page->ptr + sizeof(kma_page_t*));
+    header_t* head = (header_t*)page->ptr;
     if (DEBUG) printf("Initializing entry with first header\n");
     entry = get_page();
+    page_tag(entry, TAG_META);
     move_head(&head);
   }
 
@@ -120,7 +134,7 @@ kma_malloc(kma_size_t size)
       };
 
       assert(new_header.size >= 0);
-      assert(new_header.size <= (PAGESIZE - sizeof(header_t) - sizeof(void*)));
+      assert(new_header.size <= (PAGESIZE - sizeof(header_t)));
       void *dest = (char*)curr + sizeof(header_t) + size;
       memcpy(dest, &new_header, sizeof(header_t));
 
@@ -136,6 +150,7 @@ kma_malloc(kma_size_t size)
         print_free_list();
       }
       if (DEBUG) { printf("Checking sanity of list after alloc\n"); check_list(); }
+      g_blocks++;
       return addr;
     }
     prev = curr;
@@ -144,13 +159,14 @@ kma_malloc(kma_size_t size)
   if (DEBUG) printf("Could not find spot for memory, allocating a new page\n");
   assert(prev->next == NULL);
   kma_page_t *new_page = get_page();
-  init_page(&new_page);
+  page_tag(new_page, TAG_DATA);
+  init_page(new_page);
 
-  void* addr = new_page->ptr + sizeof(void*) + sizeof(header_t);
+  void* addr = new_page->ptr + sizeof(header_t);
   if (DEBUG) printf("Reassinging new header\n");
-  void* dest = new_page->ptr + sizeof(void*) + size + sizeof(header_t);
+  void* dest = new_page->ptr + size + sizeof(header_t);
   header_t new_header = {
-    .size = (PAGESIZE) - size - sizeof(header_t)*2 - sizeof(void*),
+    .size = (PAGESIZE) - size - sizeof(header_t)*2,
     .next = NULL
   };
   memcpy(dest, &new_header, sizeof(header_t));
@@ -163,6 +179,7 @@ kma_malloc(kma_size_t size)
     print_free_list();
   }
 
+  g_blocks++;
   return addr;
 }
 
@@ -177,6 +194,12 @@ kma_free(void* ptr, kma_size_t size)
   header_t *freed, *curr;
   header_t *prev = NULL;
 
+  if (size > MAXSIZE) {
+    free_pages(page_lookup(ptr));
+    return;
+  }
+
+  g_blocks--;
   freed = ptr - sizeof(header_t);
   freed->size = size;
   if (DEBUG) printf("Freeing: %p - <%d, %p>\n", freed, freed->size, freed->next);
@@ -225,7 +248,7 @@ coalesce()
       assert((void*)curr < (void*)curr->next);
       curr->size += ((header_t*)(curr->next))->size + sizeof(header_t);
       curr->next =  ((header_t*)(curr->next))->next;
-      assert(curr->size <= (PAGESIZE - sizeof(header_t) - sizeof(void*)));
+      assert(curr->size <= (PAGESIZE - sizeof(header_t)));
       if (DEBUG) {
         printf("Free list after coalesce\n");
         print_free_list();
@@ -253,10 +276,10 @@ attempt_to_free_pages()
   curr = get_head();
   while (curr != NULL) {
     //printf("%p has %d bytes available\n", BASEADDR(curr), curr->size);
-    if (curr->size == PAGESIZE - sizeof(header_t) - sizeof(void*)) {
+    if (curr->size == PAGESIZE - sizeof(header_t)) {
       if (DEBUG) printf("%p is empty, attemping to free it.\n", curr);
       if (curr == get_head()) {
-        page = *((kma_page_t**)(BASEADDR(curr)));
+        page = page_lookup(curr);
         move_head((header_t**)&(curr->next));
         if (DEBUG) printf("Freeing page that was the start of the list, %p\n", curr);
         free_page(page);
@@ -265,7 +288,7 @@ attempt_to_free_pages()
       } else {
         if (DEBUG) printf("Freeing the a page from the list\n");
         assert(prev != NULL);
-        page = *((kma_page_t**)(BASEADDR(curr)));
+        page = page_lookup(curr);
         prev->next = curr->next;
         free_page(page);
         attempt_to_free_pages();
@@ -303,20 +326,52 @@ check_list()
 }
 
 void
-init_page(kma_page_t **page)
+init_page(kma_page_t *page)
 {
   if (DEBUG) printf("Initializing page\n");
 
-  if (DEBUG) printf("Copying pointer to kma_page to start of page\n");
-  memcpy((*page)->ptr, page, sizeof(void*));
-
   header_t header = {
-    .size = (PAGESIZE - sizeof(header_t) - sizeof(void*)),
+    .size = (PAGESIZE - sizeof(header_t)),
     .next = NULL
   };
 
   if (DEBUG) printf("Copying first header\n");
-  memcpy((char*)((*page)->ptr) + sizeof(void*), &header, sizeof(header_t));
+  memcpy(page->ptr, &header, sizeof(header_t));
 }
 
+void
+kma_introspect(kma_introspect_t* info)
+{
+  header_t *curr;
+  void *page = NULL;
+  int avail = 0, headers = 0, seen = 0;
+
+  if (entry == NULL) return;
+
+  // the headers of a page follow each other in the list
+  for (curr = get_head(); curr != NULL; curr = curr->next) {
+    if (BASEADDR(curr) != page) {
+      if (page != NULL) kma_count_page(info, avail);
+      page = BASEADDR(curr);
+      avail = 0;
+      seen++;
+    }
+    if (curr->size > 0) kma_count_extent(info, curr->size);
+    avail += curr->size;
+    headers++;
+  }
+  if (page != NULL) kma_count_page(info, avail);
+
+  // data pages without a free header are full, the entry page is all
+  // bookkeeping
+  for (; seen < page_tag_stats()[TAG_DATA].num_in_use; seen++)
+    kma_count_page(info, 0);
+  kma_count_page(info, 0);
+
+  info->meta_bytes = (headers + g_blocks) * sizeof(header_t) + PAGESIZE;
+}
+
+kma_ops_t kma_rm_ops =
+  { "rm", kma_malloc, kma_free, NULL, kma_introspect, FALSE };
+
 #endif // KMA_RM
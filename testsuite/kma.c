@@ -44,12 +44,31 @@
  *
  ***************************************************************************/
 #define __KMA_TEST_IMPL__
+#ifdef KMA_THREADS
+#define _GNU_SOURCE // pthread_setaffinity_np()
+#endif
 
 /************System include***********************************************/
 #include <assert.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#ifdef MEASURE_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#ifdef KMA_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -62,33 +81,356 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* define MEASURE_RSS to sample the resident memory of the page pool
+ * (and of the whole process) every RSS_INTERVAL trace lines */
+#ifndef RSS_INTERVAL
+#define RSS_INTERVAL 100
+#endif
+
+/* the largest free run of the pool is sampled every FREE_RUN_INTERVAL
+ * trace lines, it takes a scan of the free lists */
+#ifndef FREE_RUN_INTERVAL
+#define FREE_RUN_INTERVAL 100
+#endif
+
+/* define MEASURE_FRAG to ask the allocator for a kma_introspect()
+ * breakdown every FRAG_INTERVAL trace lines; it goes to kma_frag.dat and
+ * is averaged per live byte after the replay, next to the ratio of the
+ * same samples (FRAG_INTERVAL 1 samples every line, like the competition
+ * ratio) */
+#ifndef FRAG_INTERVAL
+#define FRAG_INTERVAL 100
+#endif
+
+/* define MEASURE_LATENCY to time every kma_malloc and kma_free into log
+ * histograms (exact below 32 ns, then 16 buckets per power of two), per
+ * operation and per request size, in static tables so no allocation
+ * happens around the timed calls */
+#define HIST_BUCKETS (16 * 40)
+
+enum LAT_OP
+  {
+    LAT_MALLOC,
+    LAT_FREE,
+    LAT_OPS
+  };
+
+#define LAT_SIZES 6 // up to 64, 256, 1024, 4096, a page, larger
+
+typedef struct
+{
+  long counts[HIST_BUCKETS];
+  long count;
+  long total_ns;
+  long max_ns;
+} latency_hist_t;
+
+/* define MEASURE_PERF to count hardware events with perf_event_open
+ * over the replay loop alone (user space only). Counters the kernel or
+ * container refuses are left out; with none left only the getrusage
+ * times of the replay are reported. */
+typedef struct
+{
+  char* name;
+  int type;
+  long config;
+  int fd;
+} perf_counter_t;
+
+#define CACHE_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+   | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
 enum REQ_STATE
   {
     FREE,
-    USED
+    USED,
+    DENIED // too large for a page, kma_malloc returned NULL
   };
 
+/* binary traces: a header, then one fixed size record per trace line
+ * in host byte order, so a mapped file is replayed as it is. Text traces
+ * still work, the magic at the start tells them apart. A trace may also
+ * come from a pipe ("-" is stdin): text traces need not start with the
+ * request count then, and binary ones are read TRACE_CHUNK records at a
+ * time and may leave num_ops at -1 (up to the end of the stream).
+ * A trace may interleave several streams, each line of a text trace
+ * then starts with the stream it belongs to ("@2 REQUEST 17 120"); a
+ * stream frees only what it allocated. */
+#define TRACE_MAGIC "KMATRACE"
+#define TRACE_VERSION 2 // 1 had no stream in the records
+
+#ifndef TRACE_CHUNK
+#define TRACE_CHUNK 4096
+#endif
+
+/* live requests are kept in an open addressing table keyed by request
+ * id, starting at REQ_SLOTS slots and doubling once it is half full, so
+ * it only grows with the peak number of live requests */
+#ifndef REQ_SLOTS
+#define REQ_SLOTS 1024
+#endif
+
+/* in correctness mode every byte of a request is written with a pattern
+ * that is a function of the request id and the offset alone, so it is
+ * checked on free without a shadow copy; both run 16 bytes at a time.
+ * Define VERIFY_EVERY k to only fill and check every k-th request (by
+ * id) on long traces. */
+#ifndef VERIFY_EVERY
+#define VERIFY_EVERY 1
+#endif
+
+#ifndef PATTERN_SEED
+#define PATTERN_SEED 0x6b6d615f74657374UL
+#endif
+
+#define PATTERN_STEP 0x9e3779b97f4a7c15UL // odd, so no word repeats
+
+typedef unsigned long pattern_t __attribute__ ((vector_size (16)));
+
+/* the live blocks of a replay are kept in a treap ordered by address,
+ * so a block kma_malloc returns is checked against its neighbours for
+ * an overlap in O(log n), and against the page layer for lying inside a
+ * single page or run in use. On by default in both modes (not in the
+ * threaded replays), -DCHECK_OVERLAP=0 turns it off. */
+#ifndef CHECK_OVERLAP
+#define CHECK_OVERLAP 1
+#endif
+
+typedef struct
+{
+  char* start;
+  int size;
+  int id;
+  int left, right;      // node indices, -1 for none
+  unsigned int prio;    // a max-heap on these keeps it balanced
+} range_t;
+
+typedef struct
+{
+  range_t* nodes;
+  int num_nodes;
+  int root;
+  int free;             // unused nodes, linked through left
+  unsigned int seed;
+} range_index_t;
+
+typedef struct
+{
+  char magic[8];
+  int version;
+  int n_req;
+  long num_ops;
+} trace_header_t;
+
+/* one trace line, size < 0 for a FREE */
+typedef struct
+{
+  int id;
+  int size;
+  int thread; // the stream, 0 unless the trace has several
+} trace_op_t;
+
+typedef struct
+{
+  int n_req;            // 0 if the trace does not tell
+  FILE* f;
+  bool binary;
+  void* map;            // binary trace files, mapped whole
+  long map_size;
+  trace_op_t* ops;      // the mapping, or a chunk read from a stream
+  long num_ops;         // in ops[]
+  bool loaded;          // ops[] holds the whole trace (loadTrace())
+  long next;
+} trace_t;
+
 typedef struct mem
 {
+  int id;
   int size;
   void* ptr;
-  void* value; // to check correctness
-  enum REQ_STATE state;
+  enum REQ_STATE state; // FREE for an empty slot
 } mem_t;
 
+typedef struct
+{
+  mem_t* slots;
+  int num_slots;
+  int num_live;
+  int peak_live;
+} req_table_t;
+
+/* define KMA_BENCH (see the kma_bench target) to link every allocator
+ * into one binary and replay the trace against each one selected with
+ * -a (a comma separated list of names, or all) */
+#ifdef KMA_BENCH
+#define KMA_MALLOC(size) alloc_ops->malloc_fn(size)
+#define KMA_FREE(ptr, size) alloc_ops->free_fn(ptr, size)
+#define KMA_INTROSPECT(info) alloc_ops->introspect_fn(info)
+#else
+#define KMA_MALLOC(size) kma_malloc(size)
+#define KMA_FREE(ptr, size) kma_free(ptr, size)
+#define KMA_INTROSPECT(info) kma_introspect(info)
+#endif
+
+/* define KMA_THREADS as well (see the kma_bench_mt target) to replay a
+ * trace of several streams with -t threads: each stream on a thread of
+ * its own, pinned to a cpu, for 1, 2, 4, ... up to threads streams at
+ * once. Allocators that are not thread safe get every call under one
+ * lock. There are no memory checks and no competition ratio then.
+ * With -f threads the FREEs of each stream go instead through a bounded
+ * queue to a consumer thread of its own, so every free is a remote one;
+ * the pages in use are sampled every REMOTE_SAMPLE_USEC to compare their
+ * peak with the peak of the live bytes. */
+#ifdef KMA_THREADS
+#if !defined(KMA_BENCH) || !defined(KPAGE_THREADS)
+#error "KMA_THREADS needs KMA_BENCH and KPAGE_THREADS"
+#endif
+
+#ifndef REMOTE_QUEUE
+#define REMOTE_QUEUE 1024 // a power of two
+#endif
+
+#ifndef REMOTE_SAMPLE_USEC
+#define REMOTE_SAMPLE_USEC 100
+#endif
+
+/* a FREE on its way to the consumer */
+typedef struct
+{
+  void* ptr;
+  int size;
+  long ns; // when it was queued
+} remote_free_t;
+
+/* single producer, single consumer ring; each index is written by one
+ * side only */
+typedef struct
+{
+  remote_free_t slots[REMOTE_QUEUE];
+  long head;            // next to take, the consumer's
+  long tail;            // next to fill, the producer's
+  bool done;            // the producer has queued its last FREE
+} remote_queue_t;
+
+typedef struct
+{
+  trace_op_t* ops;      // the stream, in trace order
+  long num_ops;
+  int cpu;
+  pthread_barrier_t* start;
+  long ns;              // replay time of the stream
+  latency_hist_t latency[LAT_OPS];
+  // -f only
+  remote_queue_t* queue;
+  int free_cpu;         // the consumer's
+  long free_ns;         // time of the consumer
+  long num_frees;       // done by the consumer
+  long stalls;          // FREEs that waited on a full queue
+  latency_hist_t delay; // FREE queued to kma_free returned
+} stream_t;
+#endif
+
 /************Global Variables*********************************************/
 
-static int val = 0;
+#ifdef KMA_BENCH
+extern kma_ops_t kma_dummy_ops, kma_rm_ops, kma_p2fl_ops, kma_mck2_ops,
+  kma_bud_ops, kma_lzbud_ops;
+
+static kma_ops_t* allocators[] =
+  {
+    &kma_dummy_ops,
+    &kma_rm_ops,
+    &kma_p2fl_ops,
+    &kma_mck2_ops,
+    &kma_bud_ops,
+    &kma_lzbud_ops
+  };
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+static kma_ops_t* alloc_ops = NULL;
+#endif
+
+static range_index_t ranges;
+
+#ifdef KMA_THREADS
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static long live_bytes = 0; // -f, allocated and not freed yet
+static long peak_live_bytes = 0;
+static int num_running = 0;
+#endif
+
+#ifdef MEASURE_PERF
+static perf_counter_t counters[] =
+  {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,         -1 },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,       -1 },
+    { "L1D misses",    PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), -1 },
+    { "LLC misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,       -1 },
+    { "dTLB misses",   PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB), -1 },
+    { "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES,      -1 },
+    { NULL,            0,                  0,                                -1 }
+  };
+static struct rusage replayStart, replayEnd;
+#endif
+
+#ifdef MEASURE_LATENCY
+// [op][size bucket], the last bucket holds every size
+static latency_hist_t latency[LAT_OPS][LAT_SIZES + 1];
+static char* lat_op_names[] = { "kma_malloc", "kma_free" };
+static char* lat_size_names[] =
+  { "<=64", "<=256", "<=1024", "<=4096", "<=page", ">page", "all" };
+#endif
 
 /************Function Prototypes******************************************/
-void allocate();
-void deallocate();
-void fill(char*, int);
-void check(char*, char*, int);
+void allocate(req_table_t*, int, int);
+void deallocate(req_table_t*, int);
+void initRequests(req_table_t*, int);
+mem_t* findRequest(req_table_t*, int);
+void removeRequest(req_table_t*, mem_t*);
+void initRanges();
+void addRange(mem_t*);
+void removeRange(mem_t*);
+int insertRange(int, int);
+int deleteRange(int, char*);
+int mergeRanges(int, int);
+unsigned long patternSeed(int);
+void fill(char*, int, int);
+void check(char*, int, int);
 void usage();
 void error(char*, char*);
 void pass();
 void fail();
+long processRss();
+long minorFaults();
+void replay(trace_t*, double*, double*);
+void openTrace(trace_t*, char*);
+void loadTrace(trace_t*);
+int nextOp(trace_t*, trace_op_t*);
+void closeTrace(trace_t*);
+void convertTrace(char*, char*);
+long nowNsec();
+void recordLatency(int, int, long);
+void histAdd(latency_hist_t*, long);
+long histValue(int);
+long histPercentile(latency_hist_t*, double);
+void printLatency();
+void startCounters();
+void stopCounters();
+void printCounters(long);
+int selectedAllocator(char*, char*);
+#ifdef KMA_THREADS
+int splitStreams(trace_t*, stream_t**);
+double replayThreads(trace_t*, int);
+void* replayStream(void*);
+void streamMalloc(stream_t*, mem_t*, trace_op_t*);
+void streamFree(stream_t*, void*, int);
+double replayRemote(trace_t*, int);
+void* replayProducer(void*);
+void* replayConsumer(void*);
+void pinThread(int);
+#endif
 
 /************External Declaration*****************************************/
 
@@ -105,9 +447,16 @@ char *name = NULL;
 int
 main(int argc, char* argv[])
 {
+  trace_t trace;
   
   name = argv[0];
   
+  if (argc == 4 && strcmp(argv[1], "-b") == 0)
+    {
+      convertTrace(argv[2], argv[3]);
+      return 0;
+    }
+  
 #ifdef COMPETITION
   printf("%s: Running in competition mode\n", name);
 #endif
@@ -116,12 +465,160 @@ main(int argc, char* argv[])
   printf("%s: Running in correctness mode\n", name);
 #endif
 
+#ifdef KMA_BENCH
+  char* selected = "all";
+  double seconds[NUM_ALLOCATORS], ratios[NUM_ALLOCATORS];
+  int threads = 0, remote = 0, i;
+  
+  while (argc >= 4 && argv[1][0] == '-' && argv[1][1] != '\0')
+    {
+      if (strcmp(argv[1], "-a") == 0)
+	{
+	  selected = argv[2];
+	}
+#ifdef KMA_THREADS
+      else if (strcmp(argv[1], "-t") == 0 && atoi(argv[2]) > 0)
+	{
+	  threads = atoi(argv[2]);
+	}
+      else if (strcmp(argv[1], "-f") == 0 && atoi(argv[2]) > 0)
+	{
+	  remote = atoi(argv[2]);
+	}
+#endif
+      else
+	{
+	  usage();
+	}
+      argv += 2;
+      argc -= 2;
+    }
+#endif
+
+  if (argc != 2)
+    {
+      usage();
+    }
+  
+  openTrace(&trace, argv[1]);
+  
+#ifdef KMA_BENCH
+  // parsed once, then replayed for every allocator
+  loadTrace(&trace);
+  
+  for (i = 0; i < NUM_ALLOCATORS; i++)
+    {
+      seconds[i] = -1;
+      if (!selectedAllocator(selected, allocators[i]->name))
+	continue;
+      
+      if (allocators[i]->malloc_fn == NULL)
+	{
+	  printf("== %s: not implemented, skipped\n", allocators[i]->name);
+	  continue;
+	}
+      
+      printf("== %s\n", allocators[i]->name);
+      alloc_ops = allocators[i];
+      trace.next = 0;
+      // each allocator starts from the pool and the page counts it
+      // would see in a process of its own
+      page_stats_reset();
+#ifdef KMA_THREADS
+      if (threads > 0)
+	{
+	  // Mops/s of the most threads in the Ratio column
+	  seconds[i] = 0;
+	  ratios[i] = replayThreads(&trace, threads);
+	}
+      else if (remote > 0)
+	{
+	  seconds[i] = 0;
+	  ratios[i] = replayRemote(&trace, remote);
+	}
+      else
+#endif
+      replay(&trace, &seconds[i], &ratios[i]);
+      if (alloc_ops->stats_fn != NULL)
+	alloc_ops->stats_fn();
+    }
+  
+  if (threads > 0)
+    printf("Bench Allocator    Mops/s at up to %d threads\n", threads);
+  else if (remote > 0)
+    printf("Bench Allocator    Mops/s at up to %d producer/consumer pairs\n",
+	   remote);
+  else
+    printf("Bench Allocator     Replay (s)        Ratio\n");
+  for (i = 0; i < NUM_ALLOCATORS; i++)
+    {
+      if (seconds[i] < 0)
+	continue;
+      if (threads > 0 || remote > 0)
+	printf("Bench %-9s %12.2f%s\n", allocators[i]->name, ratios[i],
+	       allocators[i]->thread_safe ? "" : " (serialized)");
+      else
+	printf("Bench %-9s %12.3f %12f\n", allocators[i]->name, seconds[i],
+	       ratios[i]);
+    }
+#else
+  double seconds, ratio;
+  
+  replay(&trace, &seconds, &ratio);
+#endif
+  
+  closeTrace(&trace);
+  
+  pass();
+  return 0;
+}
+
+/* replay a trace against the allocator, print what was seen and check
+ * that everything was given back; the replay time and the competition
+ * ratio (0 in correctness mode) go to the caller */
+void
+replay(trace_t* trace, double* seconds, double* ratio)
+{
   int n_req = 0, n_alloc=0, n_dealloc=0;
   kma_page_stat_t* stat;
 
 #ifdef COMPETITION
   double ratioSum = 0.0;
   int ratioCount = 0;
+  // page bytes of each tag per allocated byte, they add up to the
+  // ratio plus 1
+  double tagRatioSum[PAGE_TAGS] = { 0.0 };
+#endif
+
+  kma_tag_stat_t* tagStat;
+  int tag;
+
+  // largest contiguous free run of the pool while it is in use
+  int minFreeRun = -1, freeRunCount = 0;
+  double freeRunSum = 0.0;
+
+#ifdef MEASURE_RSS
+  long poolResident = 0, peakPoolResident = 0;
+  long procResident = 0, peakProcResident = 0;
+  int peakTotalBytes = 0;
+#endif
+
+#ifdef MEASURE_FRAG
+  kma_introspect_t frag;
+  // the waste per live byte split three ways, they add up to the ratio
+  // of the same samples (the competition ratio samples every line)
+  double extRatioSum = 0.0, intRatioSum = 0.0, metaRatioSum = 0.0;
+  double fragRatioSum = 0.0;
+  double extentSum[KMA_EXTENT_CLASSES] = { 0.0 };
+  double occupancySum[KMA_OCCUPANCY_CLASSES] = { 0.0 };
+  double largestFreeSum = 0.0;
+  int minLargestFree = -1, fragCount = 0, i;
+  
+  FILE* fragTrace = fopen("kma_frag.dat", "w");
+  if (fragTrace == NULL)
+    {
+      error("unable to open fragmentation output file", "kma_frag.dat");
+    }
 #endif
   
 #ifndef COMPETITION
@@ -133,90 +630,230 @@ main(int argc, char* argv[])
   fprintf(allocTrace, "0 0 0\n");
 #endif
 
-  if (argc != 2)
-    {
-      usage();
-    }
+  trace_op_t op;
   
-  FILE* f_test = fopen(argv[1], "r");
-  if (f_test == NULL)
-    {
-      error("unable to open input test file", argv[1]);
-    }
+  // the number of requests in the trace file, if it tells
+  n_req = trace->n_req;
   
-  // Get the number of requests in the trace file
-  // Allocate some memory...
-  int status = fscanf(f_test, "%d\n", &n_req);
-  if(status != 1)
-    error("Couldn't read number of requests at head of file", "");
+  req_table_t requests;
+  initRequests(&requests, REQ_SLOTS);
+  initRanges();
   
-  mem_t* requests = malloc((n_req + 1)*sizeof(mem_t));
-  memset(requests, 0, (n_req + 1)*sizeof(mem_t));
+  int req_id, index = 1;
   
-  char command[16];
-  int req_id, req_size, index = 1;
-
-  // Parse the lines in the file, and call allocate or
-  // deallocate accordingly.
-  while (fscanf(f_test, "%10s", command) == 1)
+  // with KPAGE_WARM the pool and the request table (calloc'ed, so still
+  // untouched) are faulted in before the replay, so the minor faults
+  // counted during it are the allocator's own
+  if (KPAGE_WARM > 0)
     {
-      if (strcmp(command, "REQUEST") == 0)
+      long off, sysPage = sysconf(_SC_PAGESIZE);
+      
+      page_warm(KPAGE_WARM);
+      for (off = 0; off < requests.num_slots * sizeof(mem_t); off += sysPage)
 	{
-	  
-	  if (fscanf(f_test, "%d %d", &req_id, &req_size) != 2)
-	    error("Not enough arguments to REQUEST", "");
-
-	  assert(req_id >= 0 && req_id < n_req);
-	  
-	  allocate(requests, req_id, req_size);
-	  n_alloc++;
+	  ((volatile char*) requests.slots)[off] = 0;
 	}
-      else if (strcmp(command, "FREE") == 0)
+    }
+#ifdef MEASURE_LATENCY
+  memset(latency, 0, sizeof(latency));
+#endif
+  long replayFaults = minorFaults();
+  long replayStartNs = nowNsec();
+#ifdef MEASURE_PERF
+  startCounters();
+#endif
+
+  // Go through the trace, and call allocate or deallocate
+  // accordingly.
+  while (nextOp(trace, &op))
+    {
+      req_id = op.id;
+      assert(req_id >= 0 && (n_req == 0 || req_id < n_req));
+      
+      if (op.size >= 0)
 	{
-	  if (fscanf(f_test, "%d", &req_id) != 1)
-	    error("Not enough arguments to FREE", "");
-	  
-	  assert(req_id >= 0 && req_id < n_req);
-	  
-	  deallocate(requests, req_id);
-	  n_dealloc++;
+	  allocate(&requests, req_id, op.size);
+	  n_alloc++;
 	}
       else
 	{
-	  error("unknown command type:", command);
+	  deallocate(&requests, req_id);
+	  n_dealloc++;
 	}
 
       stat = page_stats();
       int totalBytes = stat->num_in_use * stat->page_size;
 
+      if (index % FREE_RUN_INTERVAL == 0 && stat->num_in_use > 0)
+	{
+	  int largestFreeRun = page_free_runs()->largest_free_run;
+	  
+	  if (minFreeRun < 0 || largestFreeRun < minFreeRun)
+	    minFreeRun = largestFreeRun;
+	  freeRunSum += largestFreeRun;
+	  freeRunCount += 1;
+	}
+
       
 #ifdef COMPETITION
-      if(req_id < n_req && n_alloc != n_dealloc)
+      // a DENIED request is live but holds no bytes, so only sample when
+      // something is allocated
+      if (currentAllocBytes > 0)
 	{
 	  // We can calculate the ratio of wasted to used memory here.
 
 	  int wastedBytes = totalBytes - currentAllocBytes;
 	  ratioSum += ((double) wastedBytes) / currentAllocBytes;
 	  ratioCount += 1;
+	  
+	  tagStat = page_tag_stats();
+	  for (tag = 0; tag < PAGE_TAGS; tag++)
+	    tagRatioSum[tag] += ((double) tagStat[tag].num_in_use * stat->page_size)
+	      / currentAllocBytes;
+	}
+#endif
+
+#ifdef MEASURE_RSS
+      if (index % RSS_INTERVAL == 0)
+	{
+	  poolResident = page_resident();
+	  procResident = processRss();
+	  if (poolResident > peakPoolResident)
+	    peakPoolResident = poolResident;
+	  if (procResident > peakProcResident)
+	    peakProcResident = procResident;
+	}
+      if (totalBytes > peakTotalBytes)
+	peakTotalBytes = totalBytes;
+#endif
+
+#ifdef MEASURE_FRAG
+      if (index % FRAG_INTERVAL == 0 && currentAllocBytes > 0)
+	{
+	  memset(&frag, 0, sizeof(frag));
+	  KMA_INTROSPECT(&frag);
+	  
+	  // runs of large requests are not described, their rounding ends
+	  // up here with the rest
+	  int internalBytes = totalBytes - currentAllocBytes - frag.free_bytes
+	    - frag.meta_bytes;
+	  extRatioSum += ((double) frag.free_bytes) / currentAllocBytes;
+	  intRatioSum += ((double) internalBytes) / currentAllocBytes;
+	  metaRatioSum += ((double) frag.meta_bytes) / currentAllocBytes;
+	  fragRatioSum += ((double) (totalBytes - currentAllocBytes))
+	    / currentAllocBytes;
+	  for (i = 0; i < KMA_EXTENT_CLASSES; i++)
+	    extentSum[i] += frag.extents[i];
+	  for (i = 0; i < KMA_OCCUPANCY_CLASSES; i++)
+	    occupancySum[i] += frag.occupancy[i];
+	  if (minLargestFree < 0 || frag.largest_free < minLargestFree)
+	    minLargestFree = frag.largest_free;
+	  largestFreeSum += frag.largest_free;
+	  fragCount += 1;
+	  
+	  fprintf(fragTrace, "%d %d %d %d %d %d %d %d\n", index,
+		  currentAllocBytes, totalBytes, frag.free_bytes, internalBytes,
+		  frag.meta_bytes, frag.largest_free, frag.num_extents);
 	}
 #endif
 
 #ifndef COMPETITION
+#ifdef MEASURE_RSS
+      fprintf(allocTrace, "%d %d %d %ld\n", index, currentAllocBytes, totalBytes,
+	      poolResident);
+#else
       fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+#endif
 #endif
       
       index += 1;
     }
 
+#ifdef MEASURE_PERF
+  stopCounters();
+#endif
+  *seconds = (nowNsec() - replayStartNs) / 1e9;
+  replayFaults = minorFaults() - replayFaults;
+  free(requests.slots);
+  free(ranges.nodes);
+  
 #ifndef COMPETITION
   fclose(allocTrace);
 #endif
+#ifdef MEASURE_FRAG
+  fclose(fragTrace);
+#endif
   
   
   stat = page_stats();
   
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  printf("Page Regions Peak/Allocated/Released: %5d/%5d/%5d\n",
+	 stat->max_regions, stat->num_region_allocs, stat->num_region_frees);
+  printf("Pool Teardowns/Rebuilds/Revivals: %5d/%5d/%5d\n",
+	 stat->num_teardowns, stat->num_rebuilds, stat->num_region_revivals);
+  printf("Page Size/Backing: %d/%s\n", stat->page_size,
+	 page_backing_name(stat->backing));
+  printf("Largest Free Run Min/Avg: %5d/%7.1f pages (%d fallbacks)\n",
+	 minFreeRun, freeRunCount ? freeRunSum / freeRunCount : 0.0,
+	 stat->num_fallbacks);
+  printf("Minor Faults During Replay: %ld (%d pages warmed)\n",
+	 replayFaults, stat->num_warm);
+  printf("Requests Replayed/Peak Live: %d/%d (%d table slots)\n",
+	 n_alloc, requests.peak_live, requests.num_slots);
+  printf("Replay Time: %.3f s\n", *seconds);
+#ifdef KPAGE_SCAVENGE
+  printf("Scavenger Released/Zeroed: %5d/%5d (%d zeroed hits, %d misses)\n",
+	 stat->num_scavenged, stat->num_prezeroed, stat->num_zero_hits,
+	 stat->num_zero_misses);
+#endif
+
+#ifdef MEASURE_LATENCY
+  printLatency();
+#endif
+
+#ifdef MEASURE_PERF
+  printCounters(n_alloc + n_dealloc);
+#endif
+
+#ifdef MEASURE_RSS
+  printf("Pages Released: %d\n", stat->num_released);
+  printf("Pages In Use Peak:            %8d KB\n", peakTotalBytes / 1024);
+  printf("Pool Resident Peak/Final:     %8ld/%8ld KB\n",
+	 peakPoolResident / 1024, page_resident() / 1024);
+  printf("Process Resident Peak/Final:  %8ld/%8ld KB\n",
+	 peakProcResident / 1024, processRss() / 1024);
+#endif
+  
+  tagStat = page_tag_stats();
+#ifdef MEASURE_FRAG
+  if (fragCount > 0)
+    {
+      printf("Fragmentation External/Internal/Metadata: %f/%f/%f per live byte"
+	     " (%d samples)\n", extRatioSum / fragCount,
+	     intRatioSum / fragCount, metaRatioSum / fragCount, fragCount);
+      printf("Fragmentation ratio of the same samples: %f\n",
+	     fragRatioSum / fragCount);
+      printf("Fragmentation Free Extents By Size:");
+      for (i = 0; i < KMA_EXTENT_CLASSES - 1; i++)
+	printf(" <=%d %.1f", 16 << i, extentSum[i] / fragCount);
+      printf(" >%d %.1f\n", 16 << (i - 1), extentSum[i] / fragCount);
+      printf("Fragmentation Pages By Occupancy:");
+      for (i = 0; i < KMA_OCCUPANCY_CLASSES; i++)
+	printf(" <=%d%% %.1f", 100 * (i + 1) / KMA_OCCUPANCY_CLASSES,
+	       occupancySum[i] / fragCount);
+      printf("\n");
+      printf("Fragmentation Largest Free Extent Min/Avg: %d/%.1f bytes\n",
+	     minLargestFree, largestFreeSum / fragCount);
+    }
+#endif
+  
+  printf("Pages By Tag Peak/Tagged:");
+  for (tag = TAG_NONE + 1; tag < PAGE_TAGS; tag++)
+    printf(" %s %d/%d", page_tag_name(tag), tagStat[tag].max_in_use,
+	   tagStat[tag].num_tagged);
+  printf("\n");
   
   if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
     {
@@ -228,12 +865,41 @@ main(int argc, char* argv[])
       error("there were memory mismatches", "");
     }
 
+  *ratio = 0;
 #ifdef COMPETITION
-  printf("Competition average ratio: %f\n", ratioSum / ratioCount);
+  if (ratioCount == 0)
+    ratioCount = 1; // nothing was ever allocated, the sums are 0
+  *ratio = ratioSum / ratioCount;
+  printf("Competition average ratio: %f\n", *ratio);
+  printf("Waste by tag (adds up to ratio + 1):");
+  for (tag = 0; tag < PAGE_TAGS; tag++)
+    printf(" %s %f", page_tag_name(tag), tagRatioSum[tag] / ratioCount);
+  printf("\n");
 #endif
+}
+
+void
+kma_count_extent(kma_introspect_t* info, int size)
+{
+  int class = 0;
   
-  pass();
-  return 0;
+  while (class < KMA_EXTENT_CLASSES - 1 && size > (16 << class))
+    class++;
+  info->extents[class] += 1;
+  info->num_extents += 1;
+  info->free_bytes += size;
+  if (size > info->largest_free)
+    info->largest_free = size;
+}
+
+void
+kma_count_page(kma_introspect_t* info, int free)
+{
+  int used = PAGESIZE - free;
+  int class = (used * KMA_OCCUPANCY_CLASSES - 1) / PAGESIZE;
+  
+  info->occupancy[class < 0 ? 0 : class] += 1;
+  info->num_pages += 1;
 }
 
 void
@@ -250,109 +916,1408 @@ pass()
   exit(0);
 }
 
-void
-usage() {
-  printf("Usage: %s traceFile\n", name);
-  exit(0);
-}
-
-void
-error(char* message, char* arg ) {
-  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
-  fail();
-}
+#ifdef KMA_BENCH
 
-void
-allocate(mem_t* requests, int req_id, int req_size)
+/* whether name is in a comma separated list (or the list is "all") */
+int
+selectedAllocator(char* list, char* name)
 {
-  mem_t* new = &requests[req_id];
-  
-  assert(new->state == FREE);
-  
-  new->size = req_size;
-  new->ptr = kma_malloc(new->size);
+  int len = strlen(name);
+  char* p;
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  if (strcmp(list, "all") == 0)
     {
-      error("got NULL from kma_malloc for alloc'able request", "");
+      return 1;
     }
   
-  if (new->ptr == NULL)
+  for (p = list; p != NULL; p = strchr(p, ','), p = (p != NULL) ? p + 1 : NULL)
     {
-      return;
+      if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+	{
+	  return 1;
+	}
     }
-
-  currentAllocBytes += req_size;
   
-#ifndef COMPETITION
-  // Only run the actual memory accesses/copies/checks if we're
-  // testing for correctness.
-  
-  new->value = malloc(new->size);
-  assert(new->value != NULL);
+  return 0;
+}
+
+#endif // KMA_BENCH
+
+#ifdef KMA_THREADS
+
+/* split a loaded trace into its streams, the number of streams is
+ * returned and *streams is malloc'ed */
+int
+splitStreams(trace_t* trace, stream_t** streams)
+{
+  int num_streams = 0;
+  stream_t* s;
+  long i;
   
-  // initialize memory
-  fill((char*)new->ptr, new->size);
+  for (i = 0; i < trace->num_ops; i++)
+    {
+      if (trace->ops[i].thread >= num_streams)
+	num_streams = trace->ops[i].thread + 1;
+    }
   
-  // copy the value for further reference
-  bcopy(new->ptr, new->value, new->size);
+  *streams = calloc(num_streams, sizeof(stream_t));
+  if (*streams == NULL)
+    {
+      error("unable to allocate the streams", "");
+    }
   
-  check((char*)new->ptr, (char*)new->value, new->size);
+  for (i = 0; i < trace->num_ops; i++)
+    {
+      (*streams)[trace->ops[i].thread].num_ops++;
+    }
+  for (s = *streams; s < *streams + num_streams; s++)
+    {
+      s->ops = malloc(s->num_ops * sizeof(trace_op_t));
+      if (s->ops == NULL && s->num_ops > 0)
+	{
+	  error("unable to allocate a stream", "");
+	}
+      s->num_ops = 0;
+    }
+  for (i = 0; i < trace->num_ops; i++)
+    {
+      s = &(*streams)[trace->ops[i].thread];
+      s->ops[s->num_ops++] = trace->ops[i];
+    }
   
-#endif
-
-  new->state = USED;
+  return num_streams;
 }
 
-void
-deallocate(mem_t* requests, int req_id)
+/* replay the streams of a trace on 1, 2, 4, ... threads up to threads
+ * (or the number of streams), printing the throughput of each run and
+ * the latency of each thread; the Mops/s of the last run is returned */
+double
+replayThreads(trace_t* trace, int threads)
 {
-  mem_t* cur = &requests[req_id];
-  
-  assert(cur->state == USED);
-  assert(cur->size > 0);
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  stream_t* streams;
+  int num_streams, n, i;
+  double mops = 0;
+  long ops, ns;
+  
+  num_streams = splitStreams(trace, &streams);
+  if (num_streams < 2)
+    {
+      error("the trace has a single stream", "generate_trace ... streams");
+    }
+  if (threads > num_streams)
+    {
+      threads = num_streams;
+    }
+  
+  if (!alloc_ops->thread_safe)
+    {
+      printf("%s is not thread safe, its calls are serialized\n",
+	     alloc_ops->name);
+    }
+  
+  for (n = 1; ; n = (n * 2 > threads) ? threads : n * 2)
+    {
+      pthread_t tids[n];
+      pthread_barrier_t start;
+      
+      pthread_barrier_init(&start, NULL, n + 1);
+      for (i = 0; i < n; i++)
+	{
+	  memset(streams[i].latency, 0, sizeof(streams[i].latency));
+	  streams[i].cpu = i % cpus;
+	  streams[i].start = &start;
+	  if (pthread_create(&tids[i], NULL, replayStream, &streams[i]) != 0)
+	    {
+	      error("unable to start a thread", "");
+	    }
+	}
+      
+      pthread_barrier_wait(&start);
+      ns = nowNsec();
+      for (i = 0; i < n; i++)
+	{
+	  pthread_join(tids[i], NULL);
+	}
+      ns = nowNsec() - ns;
+      pthread_barrier_destroy(&start);
+      
+      if (page_stats()->num_in_use != 0)
+	{
+	  error("not all pages freed", "");
+	}
+      
+      for (ops = 0, i = 0; i < n; i++)
+	ops += streams[i].num_ops;
+      mops = ops * 1e3 / ns;
+      
+      printf("Threads %2d: %10ld ops %8.3f s %8.2f Mops/s total\n",
+	     n, ops, ns / 1e9, mops);
+      printf("Thread cpu        ops   Mops/s  malloc p50/p99/max (ns)    free p50/p99/max (ns)\n");
+      for (i = 0; i < n; i++)
+	{
+	  latency_hist_t* m = &streams[i].latency[LAT_MALLOC];
+	  latency_hist_t* f = &streams[i].latency[LAT_FREE];
+	  
+	  printf("Thread %3d %3d %10ld %8.2f %8ld/%6ld/%8ld %8ld/%6ld/%8ld\n",
+		 i, streams[i].cpu, streams[i].num_ops,
+		 streams[i].num_ops * 1e3 / streams[i].ns,
+		 histPercentile(m, 50), histPercentile(m, 99), m->max_ns,
+		 histPercentile(f, 50), histPercentile(f, 99), f->max_ns);
+	}
+      
+      if (n >= threads)
+	break;
+    }
+  
+  for (i = 0; i < num_streams; i++)
+    {
+      free(streams[i].ops);
+    }
+  free(streams);
+  
+  return mops;
+}
+
+/* replay one stream on a thread pinned to its cpu, timing every call
+ * (around the lock too for allocators that need it) */
+void*
+replayStream(void* arg)
+{
+  stream_t* s = arg;
+  req_table_t requests;
+  trace_op_t* op;
+  mem_t* slot;
+  
+  pinThread(s->cpu);
+  initRequests(&requests, REQ_SLOTS);
+  pthread_barrier_wait(s->start);
+  
+  s->ns = nowNsec();
+  for (op = s->ops; op < s->ops + s->num_ops; op++)
+    {
+      slot = findRequest(&requests, op->id);
+      
+      if (op->size >= 0)
+	{
+	  streamMalloc(s, slot, op);
+	  requests.num_live++;
+	  continue;
+	}
+      
+      if (slot->state == FREE)
+	{
+	  error("a stream frees a request it did not make", "");
+	}
+      if (slot->state == USED)
+	{
+	  streamFree(s, slot->ptr, slot->size);
+	}
+      removeRequest(&requests, slot);
+    }
+  s->ns = nowNsec() - s->ns;
+  
+  free(requests.slots);
+  return NULL;
+}
+
+/* kma_malloc for a REQUEST of a stream into its (empty) slot */
+void
+streamMalloc(stream_t* s, mem_t* slot, trace_op_t* op)
+{
+  long start;
+  
+  assert(slot->state == FREE);
+  slot->id = op->id;
+  slot->size = op->size;
+  
+  start = nowNsec();
+  if (!alloc_ops->thread_safe)
+    pthread_mutex_lock(&alloc_lock);
+  slot->ptr = KMA_MALLOC(op->size);
+  if (!alloc_ops->thread_safe)
+    pthread_mutex_unlock(&alloc_lock);
+  histAdd(&s->latency[LAT_MALLOC], nowNsec() - start);
+  
+  if (slot->ptr == NULL && op->size <= (PAGESIZE - sizeof(void*)))
+    {
+      error("got NULL from kma_malloc for alloc'able request", "");
+    }
+  slot->state = (slot->ptr == NULL) ? DENIED : USED;
+}
+
+void
+streamFree(stream_t* s, void* ptr, int size)
+{
+  long start = nowNsec();
+  
+  if (!alloc_ops->thread_safe)
+    pthread_mutex_lock(&alloc_lock);
+  KMA_FREE(ptr, size);
+  if (!alloc_ops->thread_safe)
+    pthread_mutex_unlock(&alloc_lock);
+  histAdd(&s->latency[LAT_FREE], nowNsec() - start);
+}
+
+/* replay the streams of a trace on 1, 2, 4, ... producer threads up to
+ * pairs (or the number of streams), each sending its FREEs to a consumer
+ * thread of its own; the Mops/s of the last run is returned */
+double
+replayRemote(trace_t* trace, int pairs)
+{
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct timespec pause = { 0, REMOTE_SAMPLE_USEC * 1000 };
+  kma_page_stat_t* stat;
+  stream_t* streams;
+  int num_streams, n, i, peakPages;
+  long ops, frees, ns, freeNs;
+  double mops = 0;
+  
+  num_streams = splitStreams(trace, &streams);
+  if (pairs > num_streams)
+    {
+      pairs = num_streams;
+    }
+  
+  if (!alloc_ops->thread_safe)
+    {
+      printf("%s is not thread safe, its calls are serialized\n",
+	     alloc_ops->name);
+    }
+  
+  for (n = 1; ; n = (n * 2 > pairs) ? pairs : n * 2)
+    {
+      pthread_t producers[n], consumers[n];
+      pthread_barrier_t start;
+      
+      pthread_barrier_init(&start, NULL, 2 * n + 1);
+      live_bytes = peak_live_bytes = 0;
+      num_running = 2 * n;
+      for (i = 0; i < n; i++)
+	{
+	  memset(streams[i].latency, 0, sizeof(streams[i].latency));
+	  memset(&streams[i].delay, 0, sizeof(streams[i].delay));
+	  streams[i].queue = calloc(1, sizeof(remote_queue_t));
+	  if (streams[i].queue == NULL)
+	    {
+	      error("unable to allocate a remote free queue", "");
+	    }
+	  streams[i].cpu = (2 * i) % cpus;
+	  streams[i].free_cpu = (2 * i + 1) % cpus;
+	  streams[i].num_frees = streams[i].stalls = 0;
+	  streams[i].start = &start;
+	  if (pthread_create(&producers[i], NULL, replayProducer, &streams[i]) != 0
+	      || pthread_create(&consumers[i], NULL, replayConsumer, &streams[i]) != 0)
+	    {
+	      error("unable to start a thread", "");
+	    }
+	}
+      
+      pthread_barrier_wait(&start);
+      ns = nowNsec();
+      
+      // page_stats() is only called from here while they run
+      peakPages = 0;
+      while (__atomic_load_n(&num_running, __ATOMIC_ACQUIRE) > 0)
+	{
+	  stat = page_stats();
+	  if (stat->num_in_use > peakPages)
+	    peakPages = stat->num_in_use;
+	  nanosleep(&pause, NULL);
+	}
+      
+      for (i = 0; i < n; i++)
+	{
+	  pthread_join(producers[i], NULL);
+	  pthread_join(consumers[i], NULL);
+	  free(streams[i].queue);
+	}
+      ns = nowNsec() - ns;
+      pthread_barrier_destroy(&start);
+      
+      if (page_stats()->num_in_use != 0)
+	{
+	  error("not all pages freed", "");
+	}
+      
+      for (ops = frees = freeNs = 0, i = 0; i < n; i++)
+	{
+	  ops += streams[i].num_ops;
+	  frees += streams[i].num_frees;
+	  freeNs += streams[i].free_ns;
+	}
+      mops = ops * 1e3 / ns;
+      
+      printf("Remote %2d pairs: %10ld ops %8.3f s %8.2f Mops/s total, %8.2f Mfrees/s per consumer\n",
+	     n, ops, ns / 1e9, mops, frees * 1e3 / freeNs);
+      printf("Remote Peak Pages/Live: %8d/%8ld KB (blowup %.2f, pages sampled every %d us)\n",
+	     peakPages * PAGESIZE / 1024, peak_live_bytes / 1024,
+	     peak_live_bytes ? (double) peakPages * PAGESIZE / peak_live_bytes : 0.0,
+	     REMOTE_SAMPLE_USEC);
+      printf("Pair cpus   malloc p50/p99/max (ns)   remote free p50/p99/max (ns)   queue delay p50/p99 (ns)  stalls\n");
+      for (i = 0; i < n; i++)
+	{
+	  latency_hist_t* m = &streams[i].latency[LAT_MALLOC];
+	  latency_hist_t* f = &streams[i].latency[LAT_FREE];
+	  latency_hist_t* d = &streams[i].delay;
+	  
+	  printf("Pair %3d %2d/%-2d %7ld/%6ld/%8ld %10ld/%6ld/%8ld %15ld/%9ld %8ld\n",
+		 i, streams[i].cpu, streams[i].free_cpu,
+		 histPercentile(m, 50), histPercentile(m, 99), m->max_ns,
+		 histPercentile(f, 50), histPercentile(f, 99), f->max_ns,
+		 histPercentile(d, 50), histPercentile(d, 99), streams[i].stalls);
+	}
+      
+      if (n >= pairs)
+	break;
+    }
+  
+  for (i = 0; i < num_streams; i++)
+    {
+      free(streams[i].ops);
+    }
+  free(streams);
+  
+  return mops;
+}
+
+/* the REQUESTs of a stream, its FREEs are queued for the consumer */
+void*
+replayProducer(void* arg)
+{
+  stream_t* s = arg;
+  remote_queue_t* q = s->queue;
+  req_table_t requests;
+  remote_free_t* e;
+  trace_op_t* op;
+  mem_t* slot;
+  long live, peak;
+  
+  pinThread(s->cpu);
+  initRequests(&requests, REQ_SLOTS);
+  pthread_barrier_wait(s->start);
+  
+  s->ns = nowNsec();
+  for (op = s->ops; op < s->ops + s->num_ops; op++)
+    {
+      slot = findRequest(&requests, op->id);
+      
+      if (op->size >= 0)
+	{
+	  streamMalloc(s, slot, op);
+	  requests.num_live++;
+	  if (slot->state == USED)
+	    {
+	      // only adds raise the peak, so it is seen here
+	      live = __atomic_add_fetch(&live_bytes, op->size, __ATOMIC_RELAXED);
+	      peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+	      while (live > peak
+		     && !__atomic_compare_exchange_n(&peak_live_bytes, &peak,
+						     live, 0, __ATOMIC_RELAXED,
+						     __ATOMIC_RELAXED))
+		;
+	    }
+	  continue;
+	}
+      
+      if (slot->state == FREE)
+	{
+	  error("a stream frees a request it did not make", "");
+	}
+      if (slot->state == USED)
+	{
+	  if (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == REMOTE_QUEUE)
+	    {
+	      s->stalls++;
+	      while (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)
+		     == REMOTE_QUEUE)
+		sched_yield();
+	    }
+	  e = &q->slots[q->tail & (REMOTE_QUEUE - 1)];
+	  e->ptr = slot->ptr;
+	  e->size = slot->size;
+	  e->ns = nowNsec();
+	  __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+	}
+      removeRequest(&requests, slot);
+    }
+  s->ns = nowNsec() - s->ns;
+  
+  __atomic_store_n(&q->done, TRUE, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&num_running, 1, __ATOMIC_RELEASE);
+  free(requests.slots);
+  return NULL;
+}
+
+/* kma_free for the FREEs a producer queued */
+void*
+replayConsumer(void* arg)
+{
+  stream_t* s = arg;
+  remote_queue_t* q = s->queue;
+  remote_free_t* e;
+  
+  pinThread(s->free_cpu);
+  pthread_barrier_wait(s->start);
+  
+  s->free_ns = nowNsec();
+  for (;;)
+    {
+      if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head)
+	{
+	  // done is set after the last FREE is queued, look once more
+	  if (__atomic_load_n(&q->done, __ATOMIC_ACQUIRE)
+	      && __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head)
+	    break;
+	  sched_yield();
+	  continue;
+	}
+      
+      e = &q->slots[q->head & (REMOTE_QUEUE - 1)];
+      streamFree(s, e->ptr, e->size);
+      histAdd(&s->delay, nowNsec() - e->ns);
+      __atomic_sub_fetch(&live_bytes, e->size, __ATOMIC_RELAXED);
+      s->num_frees++;
+      __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    }
+  s->free_ns = nowNsec() - s->free_ns;
+  
+  __atomic_sub_fetch(&num_running, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void
+pinThread(int cpu)
+{
+  cpu_set_t cpus;
+  
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+#endif // KMA_THREADS
+
+void
+usage() {
+#if defined(KMA_THREADS)
+  printf("Usage: %s [-a all|dummy,rm,bud,...] [-t threads|-f pairs] traceFile (- for stdin)\n",
+	 name);
+#elif defined(KMA_BENCH)
+  printf("Usage: %s [-a all|dummy,rm,bud,...] traceFile (- for stdin)\n", name);
+#else
+  printf("Usage: %s traceFile (- for stdin)\n", name);
+#endif
+  printf("       %s -b textTrace binaryTrace (convert a trace)\n", name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg ) {
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  fail();
+}
+
+long
+processRss()
+{
+  long size = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  
+  if (f == NULL)
+    {
+      return -1;
+    }
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+    {
+      resident = -1;
+    }
+  fclose(f);
+  
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* minor page faults of the process so far */
+long
+minorFaults()
+{
+  struct rusage ru;
+  
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    {
+      return 0;
+    }
+  
+  return ru.ru_minflt;
+}
+
+/* open a text or binary trace, a binary one is mapped whole */
+void
+openTrace(trace_t* trace, char* path)
+{
+  trace_header_t header;
+  struct stat st;
+  int fd;
+  
+  int c;
+  
+  memset(trace, 0, sizeof(trace_t));
+  
+  trace->f = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+  if (trace->f == NULL)
+    {
+      error("unable to open input test file", path);
+    }
+  
+  // only the first character can be looked at without consuming it,
+  // which a pipe could not give back
+  c = getc(trace->f);
+  ungetc(c, trace->f);
+  
+  if (c != TRACE_MAGIC[0])
+    {
+      // a text trace, the request count up front is optional
+      while (isspace(c = getc(trace->f)))
+	;
+      ungetc(c, trace->f);
+      if (isdigit(c) && fscanf(trace->f, "%d\n", &trace->n_req) != 1)
+	error("Couldn't read number of requests at head of file", "");
+      return;
+    }
+  
+  trace->binary = TRUE;
+  if (fread(&header, sizeof(header), 1, trace->f) != 1
+      || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+    {
+      error("not a trace", path);
+    }
+  if (header.version != TRACE_VERSION)
+    {
+      error("unknown binary trace version", path);
+    }
+  trace->n_req = header.n_req;
+  
+  fd = fileno(trace->f);
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+      // a stream, read a chunk at a time
+      trace->ops = malloc(TRACE_CHUNK * sizeof(trace_op_t));
+      if (trace->ops == NULL)
+	{
+	  error("unable to allocate the trace buffer", "");
+	}
+      return;
+    }
+  
+  if ((st.st_size - sizeof(header)) % sizeof(trace_op_t) != 0
+      || (header.num_ops >= 0
+	  && st.st_size != sizeof(header) + header.num_ops * sizeof(trace_op_t)))
+    {
+      error("truncated binary trace", path);
+    }
+  
+  trace->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (trace->map == MAP_FAILED)
+    {
+      error("unable to map the trace", path);
+    }
+  madvise(trace->map, st.st_size, MADV_SEQUENTIAL);
+  
+  trace->map_size = st.st_size;
+  trace->ops = trace->map + sizeof(header);
+  trace->num_ops = (st.st_size - sizeof(header)) / sizeof(trace_op_t);
+}
+
+/* the next trace line, 0 at the end of the trace */
+int
+nextOp(trace_t* trace, trace_op_t* op)
+{
+  char command[16];
+  
+  if (trace->binary)
+    {
+      if (trace->next == trace->num_ops && trace->map == NULL
+	  && !trace->loaded)
+	{
+	  trace->num_ops = fread(trace->ops, sizeof(trace_op_t), TRACE_CHUNK,
+				 trace->f);
+	  trace->next = 0;
+	}
+      if (trace->next == trace->num_ops)
+	{
+	  return 0;
+	}
+      *op = trace->ops[trace->next++];
+      return 1;
+    }
+  
+  if (fscanf(trace->f, "%10s", command) != 1)
+    {
+      return 0;
+    }
+  
+  op->thread = 0;
+  if (command[0] == '@')
+    {
+      if (sscanf(command + 1, "%d", &op->thread) != 1 || op->thread < 0)
+	error("bad stream marker", command);
+      if (fscanf(trace->f, "%10s", command) != 1)
+	error("stream marker without a command", "");
+    }
+  
+  if (strcmp(command, "REQUEST") == 0)
+    {
+      if (fscanf(trace->f, "%d %d", &op->id, &op->size) != 2)
+	error("Not enough arguments to REQUEST", "");
+    }
+  else if (strcmp(command, "FREE") == 0)
+    {
+      if (fscanf(trace->f, "%d", &op->id) != 1)
+	error("Not enough arguments to FREE", "");
+      op->size = -1;
+    }
+  else
+    {
+      error("unknown command type:", command);
+    }
+  
+  return 1;
+}
+
+/* read the rest of a trace into memory so it can be replayed again from
+ * the start (next = 0); a mapped trace already can */
+void
+loadTrace(trace_t* trace)
+{
+  trace_op_t* ops = NULL;
+  long num_ops = 0, size = 0;
+  trace_op_t op;
+  
+  if (trace->map != NULL)
+    {
+      return;
+    }
+  
+  while (nextOp(trace, &op))
+    {
+      if (num_ops == size)
+	{
+	  size = (size == 0) ? TRACE_CHUNK : 2 * size;
+	  ops = realloc(ops, size * sizeof(trace_op_t));
+	  if (ops == NULL)
+	    {
+	      error("unable to allocate the trace", "");
+	    }
+	}
+      ops[num_ops++] = op;
+    }
+  
+  if (trace->binary)
+    {
+      free(trace->ops);
+    }
+  trace->binary = TRUE;
+  trace->loaded = TRUE;
+  trace->ops = ops;
+  trace->num_ops = num_ops;
+  trace->next = 0;
+}
+
+void
+closeTrace(trace_t* trace)
+{
+  if (trace->map != NULL)
+    {
+      munmap(trace->map, trace->map_size);
+    }
+  else if (trace->binary)
+    {
+      free(trace->ops);
+    }
+  if (trace->f != stdin)
+    {
+      fclose(trace->f);
+    }
+}
+
+/* write a text trace out as a binary one */
+void
+convertTrace(char* from, char* to)
+{
+  trace_header_t header;
+  trace_t trace;
+  trace_op_t op;
+  FILE* out;
+  
+  openTrace(&trace, from);
+  
+  out = fopen(to, "w");
+  if (out == NULL)
+    {
+      error("unable to open output trace file", to);
+    }
+  
+  // the header goes in last, once the number of records is known
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.n_req = trace.n_req;
+  fwrite(&header, sizeof(header), 1, out);
+  
+  while (nextOp(&trace, &op))
+    {
+      fwrite(&op, sizeof(op), 1, out);
+      header.num_ops++;
+    }
+  
+  rewind(out);
+  if (fwrite(&header, sizeof(header), 1, out) != 1 || fclose(out) != 0)
+    {
+      error("unable to write output trace file", to);
+    }
+  closeTrace(&trace);
+}
+
+void
+allocate(req_table_t* requests, int req_id, int req_size)
+{
+  mem_t* new = findRequest(requests, req_id);
+  
+  assert(new->state == FREE);
+  
+  requests->num_live++;
+  if (requests->num_live > requests->peak_live)
+    {
+      requests->peak_live = requests->num_live;
+    }
+  
+  new->id = req_id;
+  new->size = req_size;
+#ifdef MEASURE_LATENCY
+  long start = nowNsec();
+  new->ptr = KMA_MALLOC(new->size);
+  recordLatency(LAT_MALLOC, req_size, nowNsec() - start);
+#else
+  new->ptr = KMA_MALLOC(new->size);
+#endif
+  
+  // Accept a NULL response in some cases... (larger requests may also
+  // be served from a run of pages)
+  if ((new->ptr == NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
+    {
+      error("got NULL from kma_malloc for alloc'able request", "");
+    }
+  
+  if (new->ptr == NULL)
+    {
+      new->state = DENIED;
+      return;
+    }
+
+  if (CHECK_OVERLAP)
+    addRange(new);
+  
+  currentAllocBytes += req_size;
   
 #ifndef COMPETITION
-  // Only run the memory checks if we're testing for correctness.
+  // Only run the actual memory accesses/checks if we're testing for
+  // correctness.
+  
+  if (req_id % VERIFY_EVERY == 0)
+    fill((char*)new->ptr, req_id, new->size);
+#endif
+
+  new->state = USED;
+}
 
-  // check memory
-  check((char*)cur->ptr, (char*)cur->value, cur->size);
+void
+deallocate(req_table_t* requests, int req_id)
+{
+  mem_t* cur = findRequest(requests, req_id);
+  
+  if (cur->state == DENIED)
+    {
+      // nothing was allocated, nothing to free
+      removeRequest(requests, cur);
+      return;
+    }
+  
+  assert(cur->state == USED);
+  assert(cur->size > 0);
+  
+#ifndef COMPETITION
+  // Only run the memory checks if we're testing for correctness.
 
-  // free memory
-  free(cur->value);
+  if (req_id % VERIFY_EVERY == 0)
+    check((char*)cur->ptr, req_id, cur->size);
 #endif
 
-  kma_free(cur->ptr, cur->size);
+  if (CHECK_OVERLAP)
+    removeRange(cur);
+
+#ifdef MEASURE_LATENCY
+  long start = nowNsec();
+  KMA_FREE(cur->ptr, cur->size);
+  recordLatency(LAT_FREE, cur->size, nowNsec() - start);
+#else
+  KMA_FREE(cur->ptr, cur->size);
+#endif
 
   currentAllocBytes -= cur->size;
   
-  cur->state = FREE;
+  removeRequest(requests, cur);
 }
 
 void
-fill(char* ptr, int size)
+initRequests(req_table_t* requests, int num_slots)
+{
+  requests->slots = calloc(num_slots, sizeof(mem_t));
+  if (requests->slots == NULL)
+    {
+      error("unable to allocate the request table", "");
+    }
+  requests->num_slots = num_slots;
+  requests->num_live = 0;
+  requests->peak_live = 0;
+}
+
+#define REQ_HASH(id, n) (((unsigned int) (id) * 2654435761u) & ((n) - 1))
+
+/* the slot of a live request, or the empty slot it would go in; the
+ * table doubles first if it is half full */
+mem_t*
+findRequest(req_table_t* requests, int req_id)
 {
+  mem_t* slot;
   int i;
   
-  for (i = 0; i < size; i++)
+  if (2 * (requests->num_live + 1) > requests->num_slots)
+    {
+      req_table_t old = *requests;
+      
+      initRequests(requests, 2 * old.num_slots);
+      for (i = 0; i < old.num_slots; i++)
+	{
+	  if (old.slots[i].state != FREE)
+	    {
+	      *findRequest(requests, old.slots[i].id) = old.slots[i];
+	    }
+	}
+      requests->num_live = old.num_live;
+      requests->peak_live = old.peak_live;
+      free(old.slots);
+    }
+  
+  for (i = REQ_HASH(req_id, requests->num_slots); ;
+       i = (i + 1) & (requests->num_slots - 1))
+    {
+      slot = &requests->slots[i];
+      if (slot->state == FREE || slot->id == req_id)
+	{
+	  return slot;
+	}
+    }
+}
+
+/* empty the slot of a request, moving later requests of its probe
+ * sequence up so no lookup stops short at the hole */
+void
+removeRequest(req_table_t* requests, mem_t* slot)
+{
+  int mask = requests->num_slots - 1;
+  int hole = slot - requests->slots;
+  int i, home;
+  
+  for (i = (hole + 1) & mask; requests->slots[i].state != FREE;
+       i = (i + 1) & mask)
+    {
+      home = REQ_HASH(requests->slots[i].id, requests->num_slots);
+      
+      // it may fill the hole if its home is not in (hole, i]
+      if (((i - home) & mask) >= ((i - hole) & mask))
+	{
+	  requests->slots[hole] = requests->slots[i];
+	  hole = i;
+	}
+    }
+  
+  requests->slots[hole].state = FREE;
+  requests->num_live--;
+}
+
+long
+nowNsec()
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+#ifdef MEASURE_LATENCY
+
+/* count one call of ns nanoseconds under its size and under all sizes */
+void
+recordLatency(int op, int size, long ns)
+{
+  int sizeBucket;
+  
+  for (sizeBucket = 0; sizeBucket < LAT_SIZES - 2
+	 && size > (64 << (2 * sizeBucket)); sizeBucket++)
+    ;
+  if (sizeBucket == LAT_SIZES - 2 && size > PAGESIZE)
+    sizeBucket++;
+  
+  histAdd(&latency[op][sizeBucket], ns);
+  histAdd(&latency[op][LAT_SIZES], ns);
+}
+
+#endif // MEASURE_LATENCY
+
+void
+histAdd(latency_hist_t* hist, long ns)
+{
+  int bucket, shift;
+  
+  if (ns < 32)
+    {
+      bucket = ns;
+    }
+  else
+    {
+      shift = 63 - __builtin_clzl(ns) - 4;
+      bucket = 16 * (shift + 1) + (ns >> shift) - 16;
+      if (bucket >= HIST_BUCKETS)
+	bucket = HIST_BUCKETS - 1;
+    }
+  
+  hist->counts[bucket]++;
+  hist->count++;
+  hist->total_ns += ns;
+  if (ns > hist->max_ns)
+    hist->max_ns = ns;
+}
+
+/* the largest latency a bucket holds */
+long
+histValue(int bucket)
+{
+  int shift;
+  
+  if (bucket < 32)
+    {
+      return bucket;
+    }
+  
+  shift = bucket / 16 - 1;
+  return ((long) (bucket % 16 + 17) << shift) - 1;
+}
+
+long
+histPercentile(latency_hist_t* hist, double percentile)
+{
+  long rank = (long) (hist->count * percentile / 100.0);
+  long seen = 0;
+  int bucket;
+  
+  for (bucket = 0; bucket < HIST_BUCKETS - 1; bucket++)
+    {
+      seen += hist->counts[bucket];
+      if (seen > rank)
+	{
+	  break;
+	}
+    }
+  
+  // the bucket bound may overshoot the largest value seen
+  return (histValue(bucket) < hist->max_ns) ? histValue(bucket) : hist->max_ns;
+}
+
+#ifdef MEASURE_LATENCY
+
+void
+printLatency()
+{
+  latency_hist_t* hist;
+  int op, sizeBucket;
+  
+  printf("Latency (ns)        size      calls   Mops/s    p50    p90    p99  p99.9      max\n");
+  for (op = 0; op < LAT_OPS; op++)
+    {
+      for (sizeBucket = 0; sizeBucket <= LAT_SIZES; sizeBucket++)
+	{
+	  hist = &latency[op][sizeBucket];
+	  if (hist->count == 0)
+	    continue;
+	  
+	  printf("Latency %-10s %6s %10ld %8.2f %6ld %6ld %6ld %6ld %8ld\n",
+		 lat_op_names[op], lat_size_names[sizeBucket], hist->count,
+		 hist->count * 1e3 / hist->total_ns,
+		 histPercentile(hist, 50), histPercentile(hist, 90),
+		 histPercentile(hist, 99), histPercentile(hist, 99.9),
+		 hist->max_ns);
+	}
+    }
+}
+
+#endif // MEASURE_LATENCY
+
+#ifdef MEASURE_PERF
+
+/* open and start whatever counters the system allows */
+void
+startCounters()
+{
+  struct perf_event_attr attr;
+  perf_counter_t* c;
+  
+  for (c = counters; c->name != NULL; c++)
+    {
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = c->type;
+      attr.config = c->config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      // more counters than the PMU has get multiplexed, scaled back below
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+	| PERF_FORMAT_TOTAL_TIME_RUNNING;
+      
+      c->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+  
+  getrusage(RUSAGE_SELF, &replayStart);
+  for (c = counters; c->name != NULL; c++)
+    {
+      if (c->fd >= 0)
+	ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void
+stopCounters()
+{
+  perf_counter_t* c;
+  
+  for (c = counters; c->name != NULL; c++)
+    {
+      if (c->fd >= 0)
+	ioctl(c->fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  getrusage(RUSAGE_SELF, &replayEnd);
+}
+
+#define USAGE_SEC(tv) ((tv).tv_sec + (tv).tv_usec / 1e6)
+
+/* totals and per trace operation of the replay */
+void
+printCounters(long ops)
+{
+  long values[3]; // count, time enabled, time running
+  double count, cycles = 0, instructions = 0;
+  perf_counter_t* c;
+  int opened = 0;
+  
+  for (c = counters; c->name != NULL; c++)
+    {
+      if (c->fd < 0)
+	continue;
+      
+      if (read(c->fd, values, sizeof(values)) != sizeof(values)
+	  || values[2] == 0)
+	{
+	  close(c->fd);
+	  continue;
+	}
+      close(c->fd);
+      
+      if (opened++ == 0)
+	printf("Replay Counters (%s, %ld ops)          total       per op\n",
+	       name, ops);
+      
+      count = (double) values[0] * values[1] / values[2];
+      if (c->config == PERF_COUNT_HW_CPU_CYCLES && c->type == PERF_TYPE_HARDWARE)
+	cycles = count;
+      if (c->config == PERF_COUNT_HW_INSTRUCTIONS && c->type == PERF_TYPE_HARDWARE)
+	instructions = count;
+      
+      printf("Replay %-14s %28.0f %12.2f%s\n", c->name, count, count / ops,
+	     (values[1] != values[2]) ? " (scaled)" : "");
+    }
+  
+  if (opened == 0)
+    {
+      printf("Replay counters unavailable (perf_event_open refused), getrusage only\n");
+    }
+  else if (cycles > 0 && instructions > 0)
+    {
+      printf("Replay IPC %.2f\n", instructions / cycles);
+    }
+  
+  printf("Replay User/Sys Time: %.3f/%.3f s (%ld/%ld ctx switches)\n",
+	 USAGE_SEC(replayEnd.ru_utime) - USAGE_SEC(replayStart.ru_utime),
+	 USAGE_SEC(replayEnd.ru_stime) - USAGE_SEC(replayStart.ru_stime),
+	 replayEnd.ru_nvcsw - replayStart.ru_nvcsw,
+	 replayEnd.ru_nivcsw - replayStart.ru_nivcsw);
+}
+
+#endif // MEASURE_PERF
+
+void
+initRanges()
+{
+  memset(&ranges, 0, sizeof(ranges));
+  ranges.root = ranges.free = -1;
+  ranges.seed = 1;
+}
+
+#define RANGE(i) (ranges.nodes[i])
+
+/* check a block kma_malloc just returned and add it to the live ones */
+void
+addRange(mem_t* req)
+{
+  char* start = req->ptr;
+  char* end = start + ((req->size > 0) ? req->size : 1);
+  kma_page_t* page = page_lookup(start);
+  int pred = -1, succ = -1, other = -1;
+  char what[128];
+  int i, n;
+  
+  if (page == NULL || page_lookup(end - 1) != page)
+    {
+      sprintf(what, "request %d at %p, %d bytes", req->id, start, req->size);
+      error("kma_malloc returned a block outside a page in use", what);
+    }
+  
+  // the live block starting last at or before start and the next one
+  for (i = ranges.root; i >= 0; )
+    {
+      if (RANGE(i).start <= start)
+	{
+	  pred = i;
+	  i = RANGE(i).right;
+	}
+      else
+	{
+	  succ = i;
+	  i = RANGE(i).left;
+	}
+    }
+  
+  if (pred >= 0 && RANGE(pred).start + RANGE(pred).size > start)
+    other = pred;
+  else if (succ >= 0 && RANGE(succ).start < end)
+    other = succ;
+  
+  if (other >= 0)
+    {
+      sprintf(what, "request %d at %p, %d bytes and request %d at %p, %d bytes",
+	      req->id, start, req->size, RANGE(other).id, RANGE(other).start,
+	      RANGE(other).size);
+      error("kma_malloc returned a block overlapping a live one", what);
+    }
+  
+  if (ranges.free < 0)
+    {
+      n = (ranges.num_nodes == 0) ? REQ_SLOTS : 2 * ranges.num_nodes;
+      ranges.nodes = realloc(ranges.nodes, n * sizeof(range_t));
+      if (ranges.nodes == NULL)
+	{
+	  error("unable to allocate the live block index", "");
+	}
+      for (i = n - 1; i >= ranges.num_nodes; i--)
+	{
+	  RANGE(i).left = ranges.free;
+	  ranges.free = i;
+	}
+      ranges.num_nodes = n;
+    }
+  
+  n = ranges.free;
+  ranges.free = RANGE(n).left;
+  
+  // xorshift
+  ranges.seed ^= ranges.seed << 13;
+  ranges.seed ^= ranges.seed >> 17;
+  ranges.seed ^= ranges.seed << 5;
+  
+  RANGE(n).start = start;
+  RANGE(n).size = end - start;
+  RANGE(n).id = req->id;
+  RANGE(n).left = RANGE(n).right = -1;
+  RANGE(n).prio = ranges.seed;
+  ranges.root = insertRange(ranges.root, n);
+}
+
+void
+removeRange(mem_t* req)
+{
+  ranges.root = deleteRange(ranges.root, req->ptr);
+}
+
+/* insert node n under node t, the new root of the subtree is returned */
+int
+insertRange(int t, int n)
+{
+  int r;
+  
+  if (t < 0)
+    {
+      return n;
+    }
+  
+  if (RANGE(n).start < RANGE(t).start)
+    {
+      RANGE(t).left = insertRange(RANGE(t).left, n);
+      if (RANGE(RANGE(t).left).prio > RANGE(t).prio)
+	{
+	  // rotate right
+	  r = RANGE(t).left;
+	  RANGE(t).left = RANGE(r).right;
+	  RANGE(r).right = t;
+	  t = r;
+	}
+    }
+  else
+    {
+      RANGE(t).right = insertRange(RANGE(t).right, n);
+      if (RANGE(RANGE(t).right).prio > RANGE(t).prio)
+	{
+	  // rotate left
+	  r = RANGE(t).right;
+	  RANGE(t).right = RANGE(r).left;
+	  RANGE(r).left = t;
+	  t = r;
+	}
+    }
+  
+  return t;
+}
+
+/* take the node of the block at start out of the subtree t */
+int
+deleteRange(int t, char* start)
+{
+  int r;
+  
+  if (t < 0)
+    {
+      error("kma_free of a block that is not live", "");
+    }
+  
+  if (start < RANGE(t).start)
+    {
+      RANGE(t).left = deleteRange(RANGE(t).left, start);
+      return t;
+    }
+  if (start > RANGE(t).start)
+    {
+      RANGE(t).right = deleteRange(RANGE(t).right, start);
+      return t;
+    }
+  
+  r = mergeRanges(RANGE(t).left, RANGE(t).right);
+  RANGE(t).left = ranges.free;
+  ranges.free = t;
+  return r;
+}
+
+/* join two subtrees, every block of a before every block of b */
+int
+mergeRanges(int a, int b)
+{
+  if (a < 0)
+    {
+      return b;
+    }
+  if (b < 0)
+    {
+      return a;
+    }
+  
+  if (RANGE(a).prio > RANGE(b).prio)
+    {
+      RANGE(a).right = mergeRanges(RANGE(a).right, b);
+      return a;
+    }
+  
+  RANGE(b).left = mergeRanges(a, RANGE(b).left);
+  return b;
+}
+
+/* the first pattern word of a request (splitmix64 of its id), word i
+ * of it is seed + i * PATTERN_STEP */
+unsigned long
+patternSeed(int id)
+{
+  unsigned long z = PATTERN_SEED + (unsigned long) id * PATTERN_STEP;
+  
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+  return z ^ (z >> 31);
+}
+
+/* write the pattern of request id; ptr need not be aligned */
+void
+fill(char* ptr, int id, int size)
+{
+  unsigned long seed = patternSeed(id);
+  pattern_t word = { seed, seed + PATTERN_STEP };
+  pattern_t step = { 2 * PATTERN_STEP, 2 * PATTERN_STEP };
+  int i;
+  
+  for (i = 0; i + sizeof(pattern_t) <= size; i += sizeof(pattern_t))
     {
-      ptr[i] = (char) val++;
+      memcpy(ptr + i, &word, sizeof(pattern_t));
+      word += step;
     }
+  memcpy(ptr + i, &word, size - i);
 }
 
+/* compare with the pattern of request id, byte by byte only to report
+ * where it differs */
 void
-check(char* lhs, char* rhs, int size)
+check(char* ptr, int id, int size)
 {
+  unsigned long seed = patternSeed(id);
+  pattern_t word = { seed, seed + PATTERN_STEP };
+  pattern_t step = { 2 * PATTERN_STEP, 2 * PATTERN_STEP };
+  pattern_t diff = { 0, 0 };
+  pattern_t read;
+  char* expected;
   int i;
   
+  for (i = 0; i + sizeof(pattern_t) <= size; i += sizeof(pattern_t))
+    {
+      memcpy(&read, ptr + i, sizeof(pattern_t));
+      diff |= read ^ word;
+      word += step;
+    }
+  
+  // the last bytes, compared within zeroed vectors
+  if (i < size)
+    {
+      memset(&read, 0, sizeof(pattern_t));
+      memcpy(&read, ptr + i, size - i);
+      memset((char*) &word + (size - i), 0, sizeof(pattern_t) - (size - i));
+      diff |= read ^ word;
+    }
+  
+  if ((diff[0] | diff[1]) == 0)
+    {
+      return;
+    }
+  
   for (i = 0; i < size; i++)
     {
-      if (lhs[i] != rhs[i])
+      seed = patternSeed(id) + (i / 8) * PATTERN_STEP;
+      expected = (char*) &seed + i % 8;
+      if (ptr[i] != *expected)
 	{
 	  fprintf(stderr, "memory mismatch at position %d (%3d!=%3d)\n", 
-		  i, lhs[i], rhs[i]);
+		  i, ptr[i], *expected);
 	  anyMismatches = 1;
 	}
     }
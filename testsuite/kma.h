@@ -65,6 +65,40 @@
 
 typedef int kma_size_t;
 
+#define KMA_EXTENT_CLASSES 13   // free extents up to 16 << i bytes
+#define KMA_OCCUPANCY_CLASSES 4 // pages up to 1/4, 1/2, 3/4, all in use
+
+/* what an allocator holds in its shared pages, see kma_introspect();
+ * runs given to a single large request are left out. Whatever of the
+ * pages in use is neither live data, free nor metadata is internal
+ * fragmentation, the harness works that out. */
+typedef struct
+{
+  int num_pages;        // shared pages held, bookkeeping pages too
+  int free_bytes;       // could be handed out without a new page
+  int largest_free;     // largest free extent
+  int num_extents;
+  int extents[KMA_EXTENT_CLASSES]; // free extents by size class
+  int meta_bytes;       // headers, bitmaps, list pages
+  int occupancy[KMA_OCCUPANCY_CLASSES]; // pages by the share not free
+} kma_introspect_t;
+
+/* an allocator as the benchmark harness sees it, exported by each
+ * kma_*.c as kma_<name>_ops; malloc_fn, free_fn and introspect_fn are
+ * NULL while it is not implemented, stats_fn (extra output after a
+ * replay) may be NULL. thread_safe allocators may be called from
+ * several threads at once (over a KPAGE_THREADS page layer), the others
+ * are called under a lock */
+typedef struct
+{
+  char* name;
+  void* (*malloc_fn)(kma_size_t);
+  void (*free_fn)(void*, kma_size_t);
+  void (*stats_fn)();
+  void (*introspect_fn)(kma_introspect_t*);
+  bool thread_safe;
+} kma_ops_t;
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -91,6 +125,29 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+/***********************************************************************
+ *  Title: Describes the free memory and overhead of the allocator
+ * ---------------------------------------------------------------------
+ *    Purpose: Fills in what the allocator holds right now, to break
+ *             its waste down into external fragmentation, metadata
+ *             and internal fragmentation; not called on hot paths
+ *    Input: a zeroed kma_introspect_t
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_introspect(kma_introspect_t* info);
+
+/***********************************************************************
+ *  Title: Counts free extents and pages for kma_introspect()
+ * ---------------------------------------------------------------------
+ *    Purpose: kma_count_extent() adds a free extent of size bytes to
+ *             info (free_bytes included), kma_count_page() a page with
+ *             free bytes free in it (num_pages and occupancy)
+ *    Input: the introspection record, the size
+ *    Output: none
+ ***********************************************************************/
+void kma_count_extent(kma_introspect_t* info, int size);
+void kma_count_page(kma_introspect_t* info, int free);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/